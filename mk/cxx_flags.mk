@@ -4,6 +4,9 @@ ifdef DEBUG
 else
     INITIAL_CXX_FLAGS += -O3
 endif
+ifdef STATS
+    INITIAL_CXX_FLAGS += -DCRYPTOLEDGER_STATS
+endif
 
 CXX_FLAGS := $(INITIAL_CXX_FLAGS) $(CXX_FLAGS)
 
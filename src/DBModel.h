@@ -1,17 +1,172 @@
 #pragma once
 
+#include "Stats.h"
+
 #include <CoinCore/typedefs.h>
 
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
 namespace CryptoLedger
 {
 
+class DBStats
+{
+public:
+    StatCounter gets;
+    StatCounter getBytes;
+    StatHistogram getLatency;       // nanoseconds
+
+    StatCounter multiGets;
+    StatHistogram multiGetLatency;  // nanoseconds
+    StatCounter prefetchedKeys;
+    StatCounter prefetchHits;
+
+    StatCounter batchInserts;
+    StatCounter batchInsertBytes;
+    StatCounter batchRemoves;
+
+    StatCounter commits;
+    StatCounter commitBytes;
+    StatHistogram commitLatency;    // nanoseconds
+    StatHistogram commitBatchSize;  // bytes per write batch
+    StatHistogram commitBatchOps;   // updates per write batch
+
+    void reset();
+    std::string json() const;
+};
+
+inline void DBStats::reset()
+{
+    gets.reset();
+    getBytes.reset();
+    getLatency.reset();
+    multiGets.reset();
+    multiGetLatency.reset();
+    prefetchedKeys.reset();
+    prefetchHits.reset();
+    batchInserts.reset();
+    batchInsertBytes.reset();
+    batchRemoves.reset();
+    commits.reset();
+    commitBytes.reset();
+    commitLatency.reset();
+    commitBatchSize.reset();
+    commitBatchOps.reset();
+}
+
+inline std::string DBStats::json() const
+{
+    std::stringstream ss;
+    ss << "{\"enabled\":" << (STATS_ENABLED ? "true" : "false") << ","
+       << "\"gets\":" << statJson(gets) << ","
+       << "\"getBytes\":" << statJson(getBytes) << ","
+       << "\"getLatency\":" << statJson(getLatency) << ","
+       << "\"multiGets\":" << statJson(multiGets) << ","
+       << "\"multiGetLatency\":" << statJson(multiGetLatency) << ","
+       << "\"prefetchedKeys\":" << statJson(prefetchedKeys) << ","
+       << "\"prefetchHits\":" << statJson(prefetchHits) << ","
+       << "\"batchInserts\":" << statJson(batchInserts) << ","
+       << "\"batchInsertBytes\":" << statJson(batchInsertBytes) << ","
+       << "\"batchRemoves\":" << statJson(batchRemoves) << ","
+       << "\"commits\":" << statJson(commits) << ","
+       << "\"commitBytes\":" << statJson(commitBytes) << ","
+       << "\"commitLatency\":" << statJson(commitLatency) << ","
+       << "\"commitBatchSize\":" << statJson(commitBatchSize) << ","
+       << "\"commitBatchOps\":" << statJson(commitBatchOps) << "}";
+    return ss.str();
+}
+
+// Storage tuning passed to DBModel::open. Backends ignore settings they do not support.
+class DBOptions
+{
+public:
+    enum Profile
+    {
+        DEFAULT,        // backend defaults
+        BULK_IMPORT,    // large write buffer, no compression or syncing
+        SERVING,        // large block cache and bloom filters for random reads, synced writes
+        LOW_MEMORY      // small caches and few open files
+    };
+
+    explicit DBOptions(Profile profile = DEFAULT);
+
+    size_t blockCacheSize;      // bytes, 0 uses the backend default
+    int bloomFilterBits;        // bits per key, 0 disables bloom filters
+    size_t writeBufferSize;     // bytes
+    int maxOpenFiles;
+    size_t blockSize;           // bytes
+    bool compression;
+    bool syncWrites;
+    bool fillCacheOnScan;       // whether sequential scans populate the block cache
+    unsigned int ioThreads;     // threads serving multiGet and prefetch, 0 reads on the calling thread
+    size_t prefetchCacheSize;   // entries
+};
+
+inline DBOptions::DBOptions(Profile profile)
+    : blockCacheSize(0), bloomFilterBits(0), writeBufferSize(4 << 20), maxOpenFiles(1000), blockSize(4096), compression(true), syncWrites(false), fillCacheOnScan(true),
+      ioThreads(0), prefetchCacheSize(4096)
+{
+    switch (profile)
+    {
+    case BULK_IMPORT:
+        blockCacheSize = 32 << 20;
+        bloomFilterBits = 10;
+        writeBufferSize = 64 << 20;
+        compression = false;
+        fillCacheOnScan = false;
+        ioThreads = 4;
+        break;
+
+    case SERVING:
+        blockCacheSize = 256 << 20;
+        bloomFilterBits = 10;
+        writeBufferSize = 8 << 20;
+        maxOpenFiles = 4096;
+        syncWrites = true;
+        fillCacheOnScan = false;
+        ioThreads = 8;
+        prefetchCacheSize = 65536;
+        break;
+
+    case LOW_MEMORY:
+        blockCacheSize = 2 << 20;
+        bloomFilterBits = 10;
+        writeBufferSize = 1 << 20;
+        maxOpenFiles = 64;
+        fillCacheOnScan = false;
+        prefetchCacheSize = 1024;
+        break;
+
+    default:
+        break;
+    }
+}
+
+// Forward iterator over keys in ascending bytewise order.
+class DBIterator
+{
+public:
+    virtual ~DBIterator() { }
+
+    virtual bool valid() const = 0;
+    virtual void next() = 0;
+
+    virtual const bytes_t& key() const = 0;
+    virtual const bytes_t& value() const = 0;
+};
+
+typedef std::unique_ptr<DBIterator> DBIteratorPtr;
+
 class DBModel
 {
 public:
     DBModel() { }
     virtual ~DBModel() { }
 
-    virtual void open(const std::string& dbname) = 0;
+    virtual void open(const std::string& dbname, const DBOptions& options = DBOptions()) = 0;
     virtual void close() = 0;
     virtual bool isOpen() const = 0;
 
@@ -19,11 +174,170 @@ public:
     virtual void remove(const bytes_t& key) = 0;
     virtual void get(const bytes_t& key, bytes_t& value) const = 0;
 
+    virtual bool exists(const bytes_t& key) const;
+
+    // Looks up several keys at once. Throws if any key is missing.
+    virtual void multiGet(const std::vector<bytes_t>& keys, std::vector<bytes_t>& values) const;
+
+    // Hint that the keys will be read soon. Models with a read cache load them ahead of time; missing keys are ignored.
+    virtual void prefetch(const std::vector<bytes_t>& /*keys*/) const { }
+
+    // As above, but also returns the values so that a caller walking ahead reads each key once. Missing keys come
+    // back empty.
+    virtual void prefetch(const std::vector<bytes_t>& keys, std::vector<bytes_t>& values) const;
+
     virtual void batchInsert(const bytes_t& key, const bytes_t& value) = 0;
     virtual void batchRemove(const bytes_t& key) = 0;
 
+    // Reference counted values, for content that several owners may store under the same key. A value is stored
+    // with its first reference and removed with its last. Counts are kept under REFCOUNT_PREFIX + key.
+    uint64_t refCount(const bytes_t& key) const;
+    bool batchInsertRef(const bytes_t& key, const bytes_t& value);  // true if the value was not stored before
+    void batchAddRef(const bytes_t& key, uint64_t refs = 1);        // the value must already be stored
+    bool batchReleaseRef(const bytes_t& key);                       // true if the value was removed
+    bool batchReleaseRef(const bytes_t& key, bytes_t& removedValue);
+
     virtual void commit() = 0;
     virtual void rollback() = 0;
+
+    // Iterates over keys in [from, to), including uncommitted batch updates. An empty upper bound means no limit.
+    // Batch updates invalidate open iterators.
+    virtual DBIteratorPtr newIterator(const bytes_t& from, const bytes_t& to) const = 0;
+    DBIteratorPtr newPrefixIterator(const bytes_t& prefix) const;
+
+    const DBStats& stats() const { return stats_; }
+    void resetStats() { stats_.reset(); }
+
+protected:
+    mutable DBStats stats_;
+
+private:
+    static bytes_t refCountKey(const bytes_t& key);
+    void batchSetRefCount(const bytes_t& key, uint64_t count);
+    bool batchReleaseCountedRef(const bytes_t& key, uint64_t count);
 };
 
+const unsigned char REFCOUNT_PREFIX = 0xff;
+
+inline bool DBModel::exists(const bytes_t& key) const
+{
+    try
+    {
+        bytes_t value;
+        get(key, value);
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+inline void DBModel::multiGet(const std::vector<bytes_t>& keys, std::vector<bytes_t>& values) const
+{
+    values.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) { get(keys[i], values[i]); }
+}
+
+inline void DBModel::prefetch(const std::vector<bytes_t>& keys, std::vector<bytes_t>& values) const
+{
+    values.assign(keys.size(), bytes_t());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        try
+        {
+            get(keys[i], values[i]);
+        }
+        catch (...)
+        {
+            values[i].clear();
+        }
+    }
+}
+
+inline bytes_t DBModel::refCountKey(const bytes_t& key)
+{
+    bytes_t countKey(key.size() + 1);
+    countKey[0] = REFCOUNT_PREFIX;
+    std::copy(key.begin(), key.end(), countKey.begin() + 1);
+    return countKey;
+}
+
+inline uint64_t DBModel::refCount(const bytes_t& key) const
+{
+    // A missing count is read as no references, as exists() would report it.
+    bytes_t count;
+    try
+    {
+        get(refCountKey(key), count);
+    }
+    catch (...)
+    {
+        return 0;
+    }
+    if (count.size() != 8) throw std::runtime_error("Invalid reference count.");
+
+    uint64_t n = 0;
+    for (auto byte: count) { n = (n << 8) | byte; }
+    return n;
+}
+
+inline void DBModel::batchSetRefCount(const bytes_t& key, uint64_t count)
+{
+    bytes_t countbytes;
+    for (int i = 7; i >= 0; i--) { countbytes.push_back((count >> (8 * i)) & 0xff); }
+    batchInsert(refCountKey(key), countbytes);
+}
+
+inline bool DBModel::batchInsertRef(const bytes_t& key, const bytes_t& value)
+{
+    uint64_t count = refCount(key);
+    if (count == 0) { batchInsert(key, value); }
+    batchSetRefCount(key, count + 1);
+    return (count == 0);
+}
+
+inline void DBModel::batchAddRef(const bytes_t& key, uint64_t refs)
+{
+    uint64_t count = refCount(key);
+    if (count == 0 && !exists(key)) throw std::runtime_error("Cannot reference a missing value.");
+    batchSetRefCount(key, count + refs);
+}
+
+inline bool DBModel::batchReleaseRef(const bytes_t& key)
+{
+    return batchReleaseCountedRef(key, refCount(key));
+}
+
+inline bool DBModel::batchReleaseRef(const bytes_t& key, bytes_t& removedValue)
+{
+    uint64_t count = refCount(key);
+    if (count == 1) { get(key, removedValue); }
+    return batchReleaseCountedRef(key, count);
+}
+
+// Releases a reference given the count already read for it.
+inline bool DBModel::batchReleaseCountedRef(const bytes_t& key, uint64_t count)
+{
+    if (count == 0) throw std::runtime_error("Value has no references.");
+    if (count > 1)
+    {
+        batchSetRefCount(key, count - 1);
+        return false;
+    }
+
+    batchRemove(key);
+    batchRemove(refCountKey(key));
+    return true;
+}
+
+inline DBIteratorPtr DBModel::newPrefixIterator(const bytes_t& prefix) const
+{
+    // The upper bound is the shortest key greater than every key with this prefix.
+    bytes_t to(prefix);
+    while (!to.empty() && to.back() == 0xff) { to.pop_back(); }
+    if (!to.empty()) { to.back()++; }
+    return newIterator(prefix, to);
+}
+
 }
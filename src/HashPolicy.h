@@ -0,0 +1,148 @@
+#pragma once
+
+#include <openssl/sha.h>
+
+#include <cstddef>
+#include <cstring>
+
+#include <stdint.h>
+
+// Hash policies for merkle nodes. Each policy hashes a message into a fixed DIGEST_SIZE buffer. Policies with
+// DOMAIN_TAGS set have MerkleNode prefix leaf messages with LEAF_TAG and interior node messages with NODE_TAG.
+
+namespace CryptoLedger
+{
+
+const unsigned char LEAF_TAG = 0x00;
+const unsigned char NODE_TAG = 0x01;
+
+class Sha256HashPolicy
+{
+public:
+    static const size_t DIGEST_SIZE = 32;
+    static const bool DOMAIN_TAGS = false;
+
+    static void hash(const unsigned char* message, size_t len, unsigned char* digest) { SHA256(message, len, digest); }
+};
+
+class DoubleSha256HashPolicy
+{
+public:
+    static const size_t DIGEST_SIZE = 32;
+    static const bool DOMAIN_TAGS = false;
+
+    static void hash(const unsigned char* message, size_t len, unsigned char* digest)
+    {
+        unsigned char first[SHA256_DIGEST_LENGTH];
+        SHA256(message, len, first);
+        SHA256(first, sizeof(first), digest);
+    }
+};
+
+// MurmurHash3 x64 128-bit. Not collision resistant, only for internal indexes that never hold untrusted data.
+class FastHashPolicy
+{
+public:
+    static const size_t DIGEST_SIZE = 16;
+    static const bool DOMAIN_TAGS = false;
+
+    static void hash(const unsigned char* message, size_t len, unsigned char* digest);
+
+private:
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t fmix(uint64_t k);
+    static uint64_t load(const unsigned char* p) { uint64_t k; std::memcpy(&k, p, 8); return k; }
+};
+
+inline uint64_t FastHashPolicy::fmix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+inline void FastHashPolicy::hash(const unsigned char* message, size_t len, unsigned char* digest)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+
+    size_t blocks = len / 16;
+    for (size_t i = 0; i < blocks; i++)
+    {
+        uint64_t k1 = load(message + i * 16);
+        uint64_t k2 = load(message + i * 16 + 8);
+
+        k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char* tail = message + blocks * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    switch (len & 15)
+    {
+    case 15: k2 ^= uint64_t(tail[14]) << 48;
+    case 14: k2 ^= uint64_t(tail[13]) << 40;
+    case 13: k2 ^= uint64_t(tail[12]) << 32;
+    case 12: k2 ^= uint64_t(tail[11]) << 24;
+    case 11: k2 ^= uint64_t(tail[10]) << 16;
+    case 10: k2 ^= uint64_t(tail[9]) << 8;
+    case 9:  k2 ^= uint64_t(tail[8]);
+             k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+    case 8:  k1 ^= uint64_t(tail[7]) << 56;
+    case 7:  k1 ^= uint64_t(tail[6]) << 48;
+    case 6:  k1 ^= uint64_t(tail[5]) << 40;
+    case 5:  k1 ^= uint64_t(tail[4]) << 32;
+    case 4:  k1 ^= uint64_t(tail[3]) << 24;
+    case 3:  k1 ^= uint64_t(tail[2]) << 16;
+    case 2:  k1 ^= uint64_t(tail[1]) << 8;
+    case 1:  k1 ^= uint64_t(tail[0]);
+             k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix(h1); h2 = fmix(h2);
+    h1 += h2; h2 += h1;
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i] = (h1 >> (8 * i)) & 0xff;
+        digest[8 + i] = (h2 >> (8 * i)) & 0xff;
+    }
+}
+
+// Adds leaf/node domain separation to any policy.
+template<typename HashPolicy>
+class DomainTaggedHashPolicy : public HashPolicy
+{
+public:
+    static const bool DOMAIN_TAGS = true;
+};
+
+// Hashes count messages of len bytes each, laid out back to back, into count digests laid out the same way.
+// Interior nodes hashed together have messages of the same length, so a policy with a multi-lane kernel can
+// specialize this to hash several messages at once.
+template<typename HashPolicy>
+class BatchHasher
+{
+public:
+    static void hash(const unsigned char* messages, size_t len, size_t count, unsigned char* digests)
+    {
+        for (size_t i = 0; i < count; i++) { HashPolicy::hash(messages + i * len, len, digests + i * HashPolicy::DIGEST_SIZE); }
+    }
+};
+
+// Tags are part of the messages, so tagged policies hash them with the kernel of the policy they wrap.
+template<typename HashPolicy>
+class BatchHasher<DomainTaggedHashPolicy<HashPolicy>> : public BatchHasher<HashPolicy> { };
+
+}
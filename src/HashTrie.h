@@ -1,139 +1,718 @@
 #pragma once
 
+#include "DBModel.h"
+#include "HashPolicy.h"
+#include "NodePool.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
 #include <CoinCore/typedefs.h>
-#include <CoinCore/hash.h>
 
 #include <stdutils/uchar_vector.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <stdexcept>
+#include <utility>
 
 namespace CryptoLedger
 {
 
 const bytes_t EMPTY_BYTES;
 
-template<typename DBModelType>
+// Counters for the nodes of one tree, kept by the tree's node pool. Nodes created without a pool count towards
+// unpooledNodeStats(), which no tree reports.
+class MerkleNodeStats
+{
+public:
+    StatCounter hashes;
+    StatCounter hashBytes;
+    StatCounter nodesLoaded;
+    StatCounter nodesDeserialized;
+    StatCounter nodesShared;        // stores that found an identical node
+    StatCounter nodesFreed;
+    StatCounter payloadsLoaded;     // leaf data loaded separately from the leaf record
+
+    void reset();
+    std::string json() const;
+};
+
+inline void MerkleNodeStats::reset()
+{
+    hashes.reset();
+    hashBytes.reset();
+    nodesLoaded.reset();
+    nodesDeserialized.reset();
+    nodesShared.reset();
+    nodesFreed.reset();
+    payloadsLoaded.reset();
+}
+
+inline std::string MerkleNodeStats::json() const
+{
+    std::stringstream ss;
+    ss << "{\"enabled\":" << (STATS_ENABLED ? "true" : "false") << ","
+       << "\"hashes\":" << statJson(hashes) << ","
+       << "\"hashBytes\":" << statJson(hashBytes) << ","
+       << "\"nodesLoaded\":" << statJson(nodesLoaded) << ","
+       << "\"nodesDeserialized\":" << statJson(nodesDeserialized) << ","
+       << "\"nodesShared\":" << statJson(nodesShared) << ","
+       << "\"nodesFreed\":" << statJson(nodesFreed) << ","
+       << "\"payloadsLoaded\":" << statJson(payloadsLoaded) << "}";
+    return ss.str();
+}
+
+inline MerkleNodeStats& unpooledNodeStats()
+{
+    static MerkleNodeStats stats;
+    return stats;
+}
+
+// Counters for the operations applied to one tree.
+class MerkleTreeStats
+{
+public:
+    StatCounter appends;
+    StatCounter removes;
+    StatCounter commits;
+    StatHistogram appendLatency;    // nanoseconds
+    StatHistogram removeLatency;    // nanoseconds
+
+    void reset();
+    std::string json() const;
+};
+
+inline void MerkleTreeStats::reset()
+{
+    appends.reset();
+    removes.reset();
+    commits.reset();
+    appendLatency.reset();
+    removeLatency.reset();
+}
+
+inline std::string MerkleTreeStats::json() const
+{
+    std::stringstream ss;
+    ss << "{\"enabled\":" << (STATS_ENABLED ? "true" : "false") << ","
+       << "\"appends\":" << statJson(appends) << ","
+       << "\"removes\":" << statJson(removes) << ","
+       << "\"commits\":" << statJson(commits) << ","
+       << "\"appendLatency\":" << statJson(appendLatency) << ","
+       << "\"removeLatency\":" << statJson(removeLatency) << "}";
+    return ss.str();
+}
+
+template<typename DBModelType, typename HashPolicy = Sha256HashPolicy>
 class MerkleNode;
 
-template<typename DBModelType>
-using MerkleNodePtr = std::shared_ptr<MerkleNode<DBModelType>>;
+template<typename DBModelType, typename HashPolicy = Sha256HashPolicy>
+using MerkleNodePtr = IntrusivePtr<MerkleNode<DBModelType, HashPolicy>>;
+
+template<typename DBModelType, typename HashPolicy = Sha256HashPolicy>
+using MerkleNodePool = ObjectPool<MerkleNode<DBModelType, HashPolicy>, MerkleNodeStats>;
 
-template<typename DBModelType>
+// Key prefix of leaf payloads. Leaves are stored under their hash like interior nodes, but as a fixed size record
+// without their data, which is stored under PAYLOAD_PREFIX + hash. Walking the tree only reads the small records.
+const unsigned char PAYLOAD_PREFIX = 0xfe;
+
+// Nodes are reference counted intrusively. Nodes created from a pool return to it when released, and nodes
+// loaded from the DB are created from the pool of the node they were loaded through.
+template<typename DBModelType, typename HashPolicy>
 class MerkleNode
 {
 public:
-    MerkleNode() : size_(1) { }
-    explicit MerkleNode(const bytes_t& serialized) { setSerialized(serialized); }
-    MerkleNode(const MerkleNode<DBModelType>& leftChild, const MerkleNode<DBModelType>& rightChild);
+    MerkleNode() : size_(1), dataLoaded_(true), pending_(false), refs_(0), pool_(nullptr) { }
+    explicit MerkleNode(const bytes_t& serialized) : dataLoaded_(true), pending_(false), refs_(0), pool_(nullptr) { setSerialized(serialized); }
+    MerkleNode(const MerkleNode<DBModelType, HashPolicy>& leftChild, const MerkleNode<DBModelType, HashPolicy>& rightChild);
+
+    static MerkleNodePtr<DBModelType, HashPolicy> create(MerkleNodePool<DBModelType, HashPolicy>* pool);
+    static MerkleNodePtr<DBModelType, HashPolicy> create(MerkleNodePool<DBModelType, HashPolicy>* pool, const bytes_t& serialized);
+    static MerkleNodePtr<DBModelType, HashPolicy> createStored(MerkleNodePool<DBModelType, HashPolicy>* pool, const bytes_t& hash, const bytes_t& record);
+    static MerkleNodePtr<DBModelType, HashPolicy> create(MerkleNodePool<DBModelType, HashPolicy>* pool, const MerkleNode<DBModelType, HashPolicy>& leftChild, const MerkleNode<DBModelType, HashPolicy>& rightChild);
+
+    // Pending nodes are neither hashed nor stored when created. An interior one holds its children in memory and
+    // reads them from there. hashPending() hashes every pending node under root that has no hash yet, bottom up
+    // with one batch per level. storePending() then stores them children first and adds a reference for the
+    // caller like store(); a pending node takes a reference to each child that was already stored.
+    static MerkleNodePtr<DBModelType, HashPolicy> createPending(MerkleNodePool<DBModelType, HashPolicy>* pool, const bytes_t& data);
+    static MerkleNodePtr<DBModelType, HashPolicy> createPending(MerkleNodePool<DBModelType, HashPolicy>* pool, const MerkleNodePtr<DBModelType, HashPolicy>& leftChild, const MerkleNodePtr<DBModelType, HashPolicy>& rightChild);
+    bool isPending() const { return pending_; }
+    static void hashPending(const MerkleNodePtr<DBModelType, HashPolicy>& root);
+    static void storePending(const MerkleNodePtr<DBModelType, HashPolicy>& root, DBModelType& db);
+
+    MerkleNodePool<DBModelType, HashPolicy>* pool() const { return pool_; }
+    void addRef() const { refs_.fetch_add(1, std::memory_order_relaxed); }
+    void release() const;
 
     const bytes_t& hash() const { return hash_; }
-    const bytes_t& data() const { return data_; }
     const uint64_t& size() const { return size_; }
 
+    // Leaves loaded from the DB fetch their data on first use. data() throws if it has not been loaded.
+    bool isDataLoaded() const { return dataLoaded_; }
+    const bytes_t& data() const;
+    const bytes_t& getData(const DBModelType& db) const;
+    static void loadData(const std::vector<MerkleNodePtr<DBModelType, HashPolicy>>& nodes, const DBModelType& db);
+    static bytes_t payloadKey(const bytes_t& hash);
+
     const bytes_t& leftChildHash() const { return leftChildHash_; }
     const bytes_t& rightChildHash() const { return rightChildHash_; }
 
-    MerkleNodePtr<DBModelType> getLeftChild(const DBModelType& db) const;
-    MerkleNodePtr<DBModelType> getRightChild(const DBModelType& db) const;
+    MerkleNodePtr<DBModelType, HashPolicy> getLeftChild(const DBModelType& db) const;
+    MerkleNodePtr<DBModelType, HashPolicy> getRightChild(const DBModelType& db) const;
+    void getChildren(const DBModelType& db, MerkleNodePtr<DBModelType, HashPolicy>& leftChild, MerkleNodePtr<DBModelType, HashPolicy>& rightChild) const;
+
+    // Loads the children of all interior nodes with a single multiGet, left then right for each node. Leaves are skipped.
+    static std::vector<MerkleNodePtr<DBModelType, HashPolicy>> getChildren(const std::vector<MerkleNodePtr<DBModelType, HashPolicy>>& nodes, const DBModelType& db);
+
+    // Prefetches up to maxNodes descendants of root, breadth first with one request per level. Each level is read once
+    // and its nodes give the keys of the next.
+    static void prefetchSubtree(const MerkleNodePtr<DBModelType, HashPolicy>& root, const DBModelType& db, uint64_t maxNodes);
 
     void setData(const bytes_t& data);
     void setLeftChildHash(const bytes_t& leftChildHash);
     void setRightChildHash(const bytes_t& rightChildHash);
-    void save(DBModelType& db);
-    void erase(DBModelType& db);
+
+    // Stored nodes are reference counted: each parent holds a reference to each of its children and the tree holds
+    // one to its root, so identical subtrees are stored once. store() adds a reference for the caller, storing the
+    // node if it is new. The caller's references to the children pass to the new node, or are dropped if an
+    // identical node was already stored since that one holds its own.
+    void store(DBModelType& db) const;
+    static void holdRef(const bytes_t& hash, DBModelType& db) { db.batchAddRef(hash); }
+    // Frees the node with its last reference, and with it any children that are no longer referenced. Nodes read
+    // on the way are taken from pool.
+    static void dropRef(const bytes_t& hash, DBModelType& db, MerkleNodePool<DBModelType, HashPolicy>* pool);
+
+    // Pruning keeps only a node's hash and size. A leaf drops its data and an interior node drops its children, so
+    // a pruned subtree can still be appended to or hashed over but no longer read.
+    void prune(DBModelType& db) const;
+    bool isPruned() const { return !isLeaf() && !pending_ && leftChildHash_.empty() && rightChildHash_.empty(); }
+
+    static bytes_t parentHash(const bytes_t& leftChildHash, const bytes_t& rightChildHash);
 
     bool isLeaf() const { return (size_ == 1); }
     bool isPerfect() const { return (/*(size_ != 0) &&*/ ((size_ & (~size_ + 1)) == size_)); } // size_ is a power of 2, size cannot be zero
 
+    // A perfect tree splits in half. Otherwise the smallest perfect subtree is on the right.
+    uint64_t leftSize() const { return isPerfect() ? (size_ >> 1) : (size_ - (size_ & (~size_ + 1))); }
+
+    // The serialized form includes leaf data and is what node streams carry. The stored form leaves it out.
     bytes_t getSerialized() const;
     void setSerialized(const bytes_t& serialized);
+    bytes_t getStored() const;
+    void setStored(const bytes_t& hash, const bytes_t& record);
 
-    MerkleNodePtr<DBModelType> appendItem(const bytes_t& data, DBModelType& db);
-    MerkleNodePtr<DBModelType> removeItem(DBModelType& db);
+    MerkleNodePtr<DBModelType, HashPolicy> appendItem(const bytes_t& data, DBModelType& db);
+    MerkleNodePtr<DBModelType, HashPolicy> removeItem(DBModelType& db);
+    MerkleNodePtr<DBModelType, HashPolicy> updateItem(uint64_t i, const bytes_t& data, DBModelType& db);
 
 private:
+    // Heap allocated, not a fixed array, since hash() hands out a bytes_t. It is sized to DIGEST_SIZE once and
+    // pooled nodes keep its capacity when recycled, so rehashing a node writes in place without allocating.
     bytes_t hash_;
-    bytes_t data_;
+    mutable bytes_t data_;
     uint64_t size_;
+    mutable bool dataLoaded_;
 
     bytes_t leftChildHash_;
     bytes_t rightChildHash_;
 
-    MerkleNodePtr<DBModelType> appendTree(const MerkleNode<DBModelType>& root, DBModelType& db);
+    bool pending_;
+    MerkleNodePtr<DBModelType, HashPolicy> leftChild_;
+    MerkleNodePtr<DBModelType, HashPolicy> rightChild_;
+
+    mutable std::atomic<uint32_t> refs_;
+    MerkleNodePool<DBModelType, HashPolicy>* pool_;
+
+    MerkleNode(const MerkleNode<DBModelType, HashPolicy>&) = delete;
+    MerkleNode<DBModelType, HashPolicy>& operator=(const MerkleNode<DBModelType, HashPolicy>&) = delete;
+
+    static MerkleNode<DBModelType, HashPolicy>* allocate(MerkleNodePool<DBModelType, HashPolicy>* pool);
+    void setChildren(const MerkleNode<DBModelType, HashPolicy>& leftChild, const MerkleNode<DBModelType, HashPolicy>& rightChild);
+    void parse(const bytes_t& serialized);
+
+    // Files node and the pending nodes under it that have no hash by the height at which they can be hashed.
+    // Returns node's height, or -1 if it already has its hash.
+    static int collectUnhashed(MerkleNode<DBModelType, HashPolicy>* node, std::vector<std::vector<MerkleNode<DBModelType, HashPolicy>*>>& levels);
+
+    MerkleNodePtr<DBModelType, HashPolicy> appendTree(const MerkleNode<DBModelType, HashPolicy>& root, DBModelType& db);
 
     void updateHash();
+
+    MerkleNodeStats& nodeStats() const { return pool_ ? pool_->stats() : unpooledNodeStats(); }
 };
 
-template<typename DBModelType>
-MerkleNode<DBModelType>::MerkleNode(const MerkleNode<DBModelType>& leftChild, const MerkleNode<DBModelType>& rightChild)
+template<typename DBModelType, typename HashPolicy>
+MerkleNode<DBModelType, HashPolicy>::MerkleNode(const MerkleNode<DBModelType, HashPolicy>& leftChild, const MerkleNode<DBModelType, HashPolicy>& rightChild)
+    : dataLoaded_(true), pending_(false), refs_(0), pool_(nullptr)
+{
+    setChildren(leftChild, rightChild);
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNode<DBModelType, HashPolicy>* MerkleNode<DBModelType, HashPolicy>::allocate(MerkleNodePool<DBModelType, HashPolicy>* pool)
+{
+    if (!pool) return new MerkleNode<DBModelType, HashPolicy>();
+
+    MerkleNode<DBModelType, HashPolicy>* node = pool->acquire();
+    node->pool_ = pool;
+    return node;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::create(MerkleNodePool<DBModelType, HashPolicy>* pool)
+{
+    MerkleNode<DBModelType, HashPolicy>* node = allocate(pool);
+    node->size_ = 1;
+    node->hash_.clear();
+    node->data_.clear();
+    node->dataLoaded_ = true;
+    node->leftChildHash_.clear();
+    node->rightChildHash_.clear();
+    return MerkleNodePtr<DBModelType, HashPolicy>(node);
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::create(MerkleNodePool<DBModelType, HashPolicy>* pool, const bytes_t& serialized)
+{
+    MerkleNodePtr<DBModelType, HashPolicy> node(allocate(pool));
+    node->setSerialized(serialized);
+    return node;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::createStored(MerkleNodePool<DBModelType, HashPolicy>* pool, const bytes_t& hash, const bytes_t& record)
+{
+    MerkleNodePtr<DBModelType, HashPolicy> node(allocate(pool));
+    node->setStored(hash, record);
+    return node;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::create(MerkleNodePool<DBModelType, HashPolicy>* pool, const MerkleNode<DBModelType, HashPolicy>& leftChild, const MerkleNode<DBModelType, HashPolicy>& rightChild)
+{
+    MerkleNodePtr<DBModelType, HashPolicy> node(allocate(pool));
+    node->data_.clear();
+    node->dataLoaded_ = true;
+    node->setChildren(leftChild, rightChild);
+    return node;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::createPending(MerkleNodePool<DBModelType, HashPolicy>* pool, const bytes_t& data)
+{
+    MerkleNodePtr<DBModelType, HashPolicy> node = create(pool);
+    node->data_ = data;
+    node->pending_ = true;
+    return node;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::createPending(MerkleNodePool<DBModelType, HashPolicy>* pool, const MerkleNodePtr<DBModelType, HashPolicy>& leftChild, const MerkleNodePtr<DBModelType, HashPolicy>& rightChild)
+{
+    MerkleNodePtr<DBModelType, HashPolicy> node = create(pool);
+    node->size_ = leftChild->size() + rightChild->size();
+    node->pending_ = true;
+    node->leftChild_ = leftChild;
+    node->rightChild_ = rightChild;
+    return node;
+}
+
+template<typename DBModelType, typename HashPolicy>
+int MerkleNode<DBModelType, HashPolicy>::collectUnhashed(MerkleNode<DBModelType, HashPolicy>* node, std::vector<std::vector<MerkleNode<DBModelType, HashPolicy>*>>& levels)
+{
+    if (!node->hash_.empty()) return -1;
+
+    int height = 0;
+    if (!node->isLeaf()) { height = 1 + std::max(collectUnhashed(node->leftChild_.get(), levels), collectUnhashed(node->rightChild_.get(), levels)); }
+    if (levels.size() <= (size_t)height) { levels.resize(height + 1); }
+    levels[height].push_back(node);
+    return height;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::hashPending(const MerkleNodePtr<DBModelType, HashPolicy>& root)
+{
+    std::vector<std::vector<MerkleNode<DBModelType, HashPolicy>*>> levels;
+    collectUnhashed(root.get(), levels);
+
+    const size_t DIGEST_SIZE = HashPolicy::DIGEST_SIZE;
+    const size_t TAG_SIZE = HashPolicy::DOMAIN_TAGS ? 1 : 0;
+    const size_t len = TAG_SIZE + 2 * DIGEST_SIZE;
+    bytes_t messages;
+    bytes_t digests;
+    std::vector<MerkleNode<DBModelType, HashPolicy>*> interior;
+    for (auto& level: levels)
+    {
+        // Leaf messages differ in length, so leaves are hashed one at a time.
+        interior.clear();
+        for (auto node: level)
+        {
+            if (node->isLeaf())     { node->updateHash(); }
+            else                    { interior.push_back(node); }
+        }
+        if (interior.empty()) continue;
+
+        messages.resize(interior.size() * len);
+        digests.resize(interior.size() * DIGEST_SIZE);
+        for (size_t i = 0; i < interior.size(); i++)
+        {
+            MerkleNode<DBModelType, HashPolicy>* node = interior[i];
+            node->leftChildHash_ = node->leftChild_->hash_;
+            node->rightChildHash_ = node->rightChild_->hash_;
+
+            unsigned char* m = &messages[i * len];
+            if (TAG_SIZE) { m[0] = NODE_TAG; }
+            std::memcpy(m + TAG_SIZE, &node->leftChildHash_[0], DIGEST_SIZE);
+            std::memcpy(m + TAG_SIZE + DIGEST_SIZE, &node->rightChildHash_[0], DIGEST_SIZE);
+        }
+        BatchHasher<HashPolicy>::hash(&messages[0], len, interior.size(), &digests[0]);
+        for (size_t i = 0; i < interior.size(); i++) { interior[i]->hash_.assign(digests.begin() + i * DIGEST_SIZE, digests.begin() + (i + 1) * DIGEST_SIZE); }
+
+        root->nodeStats().hashes.add(interior.size());
+        root->nodeStats().hashBytes.add(interior.size() * len);
+    }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::storePending(const MerkleNodePtr<DBModelType, HashPolicy>& root, DBModelType& db)
+{
+    if (!root->pending_)
+    {
+        holdRef(root->hash_, db);
+        return;
+    }
+
+    if (!root->isLeaf())
+    {
+        storePending(root->leftChild_, db);
+        storePending(root->rightChild_, db);
+        root->leftChild_.reset();
+        root->rightChild_.reset();
+    }
+    root->store(db);
+    root->pending_ = false;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::release() const
+{
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    MerkleNode<DBModelType, HashPolicy>* node = const_cast<MerkleNode<DBModelType, HashPolicy>*>(this);
+    node->pending_ = false;
+    node->leftChild_.reset();
+    node->rightChild_.reset();
+    if (pool_)  { pool_->recycle(node); }
+    else        { delete node; }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::setChildren(const MerkleNode<DBModelType, HashPolicy>& leftChild, const MerkleNode<DBModelType, HashPolicy>& rightChild)
 {
     size_ = leftChild.size() + rightChild.size();
-    leftChildHash_ = leftChild.hash();
-    rightChildHash_ = rightChild.hash();
+    leftChildHash_.assign(leftChild.hash().begin(), leftChild.hash().end());
+    rightChildHash_.assign(rightChild.hash().begin(), rightChild.hash().end());
     updateHash();
 }
 
-template<typename DBModelType>
-void MerkleNode<DBModelType>::setData(const bytes_t& data)
+template<typename DBModelType, typename HashPolicy>
+const bytes_t& MerkleNode<DBModelType, HashPolicy>::data() const
+{
+    if (!dataLoaded_) throw std::runtime_error("Leaf data is not loaded.");
+    return data_;
+}
+
+template<typename DBModelType, typename HashPolicy>
+const bytes_t& MerkleNode<DBModelType, HashPolicy>::getData(const DBModelType& db) const
+{
+    if (!dataLoaded_)
+    {
+        nodeStats().payloadsLoaded.add();
+        db.get(payloadKey(hash_), data_);
+        dataLoaded_ = true;
+    }
+    return data_;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::loadData(const std::vector<MerkleNodePtr<DBModelType, HashPolicy>>& nodes, const DBModelType& db)
+{
+    std::vector<bytes_t> keys;
+    for (auto& node: nodes)
+    {
+        if (!node->dataLoaded_) { keys.push_back(payloadKey(node->hash_)); }
+    }
+    if (keys.empty()) return;
+
+    nodes.front()->nodeStats().payloadsLoaded.add(keys.size());
+    std::vector<bytes_t> data;
+    db.multiGet(keys, data);
+    size_t i = 0;
+    for (auto& node: nodes)
+    {
+        if (node->dataLoaded_) continue;
+        node->data_.swap(data[i++]);
+        node->dataLoaded_ = true;
+    }
+}
+
+template<typename DBModelType, typename HashPolicy>
+bytes_t MerkleNode<DBModelType, HashPolicy>::payloadKey(const bytes_t& hash)
+{
+    bytes_t key(1 + hash.size(), PAYLOAD_PREFIX);
+    std::copy(hash.begin(), hash.end(), key.begin() + 1);
+    return key;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::setData(const bytes_t& data)
 {
     data_ = data;
+    dataLoaded_ = true;
     updateHash();
 }
 
-template<typename DBModelType>
-void MerkleNode<DBModelType>::setLeftChildHash(const bytes_t& leftChildHash)
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::setLeftChildHash(const bytes_t& leftChildHash)
 {
     leftChildHash_ = leftChildHash;
     updateHash();
 }
 
-template<typename DBModelType>
-void MerkleNode<DBModelType>::setRightChildHash(const bytes_t& rightChildHash)
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::setRightChildHash(const bytes_t& rightChildHash)
 {
     rightChildHash_ = rightChildHash;
     updateHash();
 }
 
-template<typename DBModelType>
-void MerkleNode<DBModelType>::save(DBModelType& db)
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::store(DBModelType& db) const
 {
-    bytes_t serialized = getSerialized();
-    db.batchInsert(hash_, serialized);
+    if (db.batchInsertRef(hash_, getStored()))
+    {
+        if (isLeaf()) { db.batchInsert(payloadKey(hash_), data()); }
+        return;
+    }
+
+    // The leaf this one matches may have had its payload pruned.
+    nodeStats().nodesShared.add();
+    if (isLeaf())
+    {
+        if (!db.exists(payloadKey(hash_))) { db.batchInsert(payloadKey(hash_), data()); }
+        return;
+    }
+    dropRef(leftChildHash_, db, pool_);
+    dropRef(rightChildHash_, db, pool_);
 }
 
-template<typename DBModelType>
-void MerkleNode<DBModelType>::erase(DBModelType& db)
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::dropRef(const bytes_t& hash, DBModelType& db, MerkleNodePool<DBModelType, HashPolicy>* pool)
 {
-    db.batchRemove(hash_);
+    std::vector<bytes_t> hashes(1, hash);
+    while (!hashes.empty())
+    {
+        bytes_t hash = hashes.back();
+        hashes.pop_back();
+        bytes_t record;
+        if (!db.batchReleaseRef(hash, record)) continue;
+
+        MerkleNodePtr<DBModelType, HashPolicy> node = createStored(pool, hash, record);
+        node->nodeStats().nodesFreed.add();
+        if (node->isLeaf())
+        {
+            db.batchRemove(payloadKey(hash));
+            continue;
+        }
+        if (node->isPruned()) continue;
+        hashes.push_back(node->rightChildHash());
+        hashes.push_back(node->leftChildHash());
+    }
 }
 
-template<typename DBModelType>
-MerkleNodePtr<DBModelType> MerkleNode<DBModelType>::getLeftChild(const DBModelType& db) const
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::prune(DBModelType& db) const
 {
+    if (isLeaf())
+    {
+        db.batchRemove(payloadKey(hash_));
+        return;
+    }
+    if (isPruned()) return;
+
+    // The record keeps its references, while those it held to its children are dropped.
+    MerkleNode<DBModelType, HashPolicy> record;
+    record.size_ = size_;
+    db.batchInsert(hash_, record.getSerialized());
+    dropRef(leftChildHash_, db, pool_);
+    dropRef(rightChildHash_, db, pool_);
+}
+
+template<typename DBModelType, typename HashPolicy>
+bytes_t MerkleNode<DBModelType, HashPolicy>::parentHash(const bytes_t& leftChildHash, const bytes_t& rightChildHash)
+{
+    MerkleNode<DBModelType, HashPolicy> node;
+    node.size_ = 2;
+    node.leftChildHash_ = leftChildHash;
+    node.rightChildHash_ = rightChildHash;
+    node.updateHash();
+    return node.hash_;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::getLeftChild(const DBModelType& db) const
+{
+    if (leftChild_) return leftChild_;
+    if (isPruned()) throw std::runtime_error("Subtree has been pruned.");
     if (leftChildHash_.empty()) throw std::runtime_error("Node does not have a left child.");
 
+    nodeStats().nodesLoaded.add();
     bytes_t serialized;
     db.get(leftChildHash_, serialized);
-    return std::make_shared<MerkleNode<DBModelType>>(serialized);
+    return createStored(pool_, leftChildHash_, serialized);
 }
 
-template<typename DBModelType>
-MerkleNodePtr<DBModelType> MerkleNode<DBModelType>::getRightChild(const DBModelType& db) const
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::getRightChild(const DBModelType& db) const
 {
+    if (rightChild_) return rightChild_;
+    if (isPruned()) throw std::runtime_error("Subtree has been pruned.");
     if (rightChildHash_.empty()) throw std::runtime_error("Node does not have a right child.");
 
+    nodeStats().nodesLoaded.add();
     bytes_t serialized;
     db.get(rightChildHash_, serialized);
-    return std::make_shared<MerkleNode<DBModelType>>(serialized);
+    return createStored(pool_, rightChildHash_, serialized);
 }
 
-template<typename DBModelType>
-bytes_t MerkleNode<DBModelType>::getSerialized() const
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::getChildren(const DBModelType& db, MerkleNodePtr<DBModelType, HashPolicy>& leftChild, MerkleNodePtr<DBModelType, HashPolicy>& rightChild) const
+{
+    if (leftChild_)
+    {
+        leftChild = leftChild_;
+        rightChild = rightChild_;
+        return;
+    }
+    if (isPruned()) throw std::runtime_error("Subtree has been pruned.");
+    if (leftChildHash_.empty()) throw std::runtime_error("Node does not have a left child.");
+    if (rightChildHash_.empty()) throw std::runtime_error("Node does not have a right child.");
+
+    nodeStats().nodesLoaded.add(2);
+    std::vector<bytes_t> keys;
+    keys.push_back(leftChildHash_);
+    keys.push_back(rightChildHash_);
+    std::vector<bytes_t> serialized;
+    db.multiGet(keys, serialized);
+    leftChild = createStored(pool_, leftChildHash_, serialized[0]);
+    rightChild = createStored(pool_, rightChildHash_, serialized[1]);
+}
+
+template<typename DBModelType, typename HashPolicy>
+std::vector<MerkleNodePtr<DBModelType, HashPolicy>> MerkleNode<DBModelType, HashPolicy>::getChildren(const std::vector<MerkleNodePtr<DBModelType, HashPolicy>>& nodes, const DBModelType& db)
+{
+    std::vector<bytes_t> keys;
+    for (auto& node: nodes)
+    {
+        if (node->isLeaf() || node->isPending()) continue;
+        if (node->isPruned()) throw std::runtime_error("Subtree has been pruned.");
+        keys.push_back(node->leftChildHash());
+        keys.push_back(node->rightChildHash());
+    }
+
+    std::vector<bytes_t> serialized;
+    if (!keys.empty())
+    {
+        nodes.front()->nodeStats().nodesLoaded.add(keys.size());
+        db.multiGet(keys, serialized);
+    }
+
+    // Pending children are already in memory and keep their place among the loaded ones.
+    std::vector<MerkleNodePtr<DBModelType, HashPolicy>> children;
+    size_t i = 0;
+    for (auto& node: nodes)
+    {
+        if (node->isLeaf()) continue;
+        if (node->isPending())
+        {
+            children.push_back(node->leftChild_);
+            children.push_back(node->rightChild_);
+            continue;
+        }
+        children.push_back(createStored(node->pool(), keys[i], serialized[i]));
+        children.push_back(createStored(node->pool(), keys[i + 1], serialized[i + 1]));
+        i += 2;
+    }
+    return children;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::prefetchSubtree(const MerkleNodePtr<DBModelType, HashPolicy>& root, const DBModelType& db, uint64_t maxNodes)
+{
+    if (!root) return;
+
+    std::vector<MerkleNodePtr<DBModelType, HashPolicy>> level(1, root);
+    uint64_t count = 0;
+    while (true)
+    {
+        std::vector<MerkleNodePtr<DBModelType, HashPolicy>> parents;
+        std::vector<bytes_t> keys;
+        for (auto& node: level)
+        {
+            if (node->isLeaf() || node->isPruned()) continue;
+            parents.push_back(node);
+            if (node->isPending()) continue;
+            keys.push_back(node->leftChildHash());
+            keys.push_back(node->rightChildHash());
+        }
+        count += 2 * parents.size();
+        if (parents.empty() || count > maxNodes) return;
+
+        std::vector<bytes_t> values;
+        if (!keys.empty())
+        {
+            root->nodeStats().nodesLoaded.add(keys.size());
+            db.prefetch(keys, values);
+        }
+
+        // Pending children are already in memory. Missing ones are left for the traversal to report.
+        std::vector<MerkleNodePtr<DBModelType, HashPolicy>> children;
+        size_t i = 0;
+        for (auto& node: parents)
+        {
+            if (node->isPending())
+            {
+                children.push_back(node->leftChild_);
+                children.push_back(node->rightChild_);
+                continue;
+            }
+            for (size_t n = i; n < i + 2; n++)
+            {
+                if (!values[n].empty()) { children.push_back(createStored(node->pool(), keys[n], values[n])); }
+            }
+            i += 2;
+        }
+        level.swap(children);
+    }
+}
+
+template<typename DBModelType, typename HashPolicy>
+bytes_t MerkleNode<DBModelType, HashPolicy>::getSerialized() const
 {
     uchar_vector rval;
     uint32_t len;
+    rval.reserve(20 + leftChildHash_.size() + data_.size() + rightChildHash_.size());
 
     // TODO: More compact encoding
     rval.push_back(size_ >> 56);
@@ -169,8 +748,43 @@ bytes_t MerkleNode<DBModelType>::getSerialized() const
     return rval;
 }
 
-template<typename DBModelType>
-void MerkleNode<DBModelType>::setSerialized(const bytes_t& serialized)
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::setSerialized(const bytes_t& serialized)
+{
+    parse(serialized);
+    dataLoaded_ = true;
+    updateHash();
+}
+
+// A leaf is stored as a serialized node without data, so its record is the same size for every leaf.
+template<typename DBModelType, typename HashPolicy>
+bytes_t MerkleNode<DBModelType, HashPolicy>::getStored() const
+{
+    if (!isLeaf()) return getSerialized();
+
+    MerkleNode<DBModelType, HashPolicy> record;
+    return record.getSerialized();
+}
+
+// Leaves and pruned nodes keep the hash they were stored under since what it was computed from is not at hand. A
+// leaf record that still carries its data is taken as loaded.
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::setStored(const bytes_t& hash, const bytes_t& record)
+{
+    parse(record);
+    if ((isLeaf() && data_.empty()) || isPruned())
+    {
+        hash_ = hash;
+        dataLoaded_ = !isLeaf();
+        return;
+    }
+
+    dataLoaded_ = true;
+    updateHash();
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::parse(const bytes_t& serialized)
 {
     uint32_t len;
     uint32_t pos = 0;
@@ -184,6 +798,7 @@ void MerkleNode<DBModelType>::setSerialized(const bytes_t& serialized)
     len = ((uint32_t)serialized[pos] << 24) | ((uint32_t)serialized[pos + 1] << 16) | ((uint32_t)serialized[pos + 2] << 8) | ((uint32_t)serialized[pos + 3]);
     pos += 4;
     if (serialized.size() < pos + len) throw std::runtime_error("Invalid merkle node serialization");
+    if (len != 0 && len != HashPolicy::DIGEST_SIZE) throw std::runtime_error("Invalid merkle node serialization");
     leftChildHash_.assign(serialized.begin() + pos, serialized.begin() + pos + len);
     pos += len;
 
@@ -194,164 +809,666 @@ void MerkleNode<DBModelType>::setSerialized(const bytes_t& serialized)
     data_.assign(serialized.begin() + pos, serialized.begin() + pos + len);
     pos += len;
 
-    if (serialized.size() < 4) throw std::runtime_error("Invalid merkle node serialization");
+    if (serialized.size() - pos < 4) throw std::runtime_error("Invalid merkle node serialization");
     len = ((uint32_t)serialized[pos] << 24) | ((uint32_t)serialized[pos + 1] << 16) | ((uint32_t)serialized[pos + 2] << 8) | ((uint32_t)serialized[pos + 3]);
     pos += 4;
     if (serialized.size() < pos + len) throw std::runtime_error("Invalid merkle node serialization");
+    if (len != 0 && len != HashPolicy::DIGEST_SIZE) throw std::runtime_error("Invalid merkle node serialization");
     rightChildHash_.assign(serialized.begin() + pos, serialized.begin() + pos + len);
     pos += len;
 
     if (pos > serialized.size()) throw std::runtime_error("Invalid merkle node serialization");
 
-    updateHash();
+    nodeStats().nodesDeserialized.add();
 }
 
-template<typename DBModelType>
-MerkleNodePtr<DBModelType> MerkleNode<DBModelType>::appendItem(const bytes_t& data, DBModelType& db)
+// The tree operations below leave this node untouched and return the root of the new tree, holding one reference
+// for the caller. The caller drops its reference to this node once the new root has replaced it.
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::appendItem(const bytes_t& data, DBModelType& db)
 {
-    MerkleNode newRightChild;
-    newRightChild.setData(data);
-    newRightChild.save(db);
-
-    if (size_ == 1)
-    {
-        MerkleNodePtr<DBModelType> newRoot = std::make_shared<MerkleNode<DBModelType>>(*this, newRightChild);
-        newRoot->save(db);
-        return newRoot;
-    }
-    else if (size_ & 0x1)
+    if (size_ != 1 && (size_ & 0x1))
     {
         // size is odd, append to right child and merge into left child if possible
-        MerkleNodePtr<DBModelType> rightChild = getRightChild(db);
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        getChildren(db, leftChild, rightChild);
         rightChild = rightChild->appendItem(data, db);
-        erase(db); // This node no longer exists
-        return getLeftChild(db)->appendTree(*rightChild, db);
-    }     
-    else
-    {
-        // size is even, create new root with this for left child and new item for right child
-        MerkleNodePtr<DBModelType> newRoot = std::make_shared<MerkleNode<DBModelType>>(*this, newRightChild);
-        newRoot->save(db);
-        return newRoot;
+        return leftChild->appendTree(*rightChild, db);
     }
+
+    // size is one or even, create new root with this for left child and new item for right child
+    MerkleNodePtr<DBModelType, HashPolicy> newRightChild = create(pool_);
+    newRightChild->setData(data);
+    newRightChild->store(db);
+    holdRef(hash_, db);
+
+    MerkleNodePtr<DBModelType, HashPolicy> newRoot = create(pool_, *this, *newRightChild);
+    newRoot->store(db);
+    return newRoot;
 }
 
-template<typename DBModelType>
-MerkleNodePtr<DBModelType> MerkleNode<DBModelType>::appendTree(const MerkleNode<DBModelType>& root, DBModelType& db)
+// root holds a reference that passes to the returned tree.
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::appendTree(const MerkleNode<DBModelType, HashPolicy>& root, DBModelType& db)
 {
     if (size_ < root.size()) throw std::runtime_error("Cannot merge larger tree into smaller one.");
 
     if (!(size_ & root.size()))
     {
         // No trees of same size, just append tree as new right child
-        MerkleNodePtr<DBModelType> newRoot = std::make_shared<MerkleNode<DBModelType>>(*this, root);
-        newRoot->save(db);
+        holdRef(hash_, db);
+        MerkleNodePtr<DBModelType, HashPolicy> newRoot = create(pool_, *this, root);
+        newRoot->store(db);
         return newRoot;
     }
     else if (size_ == root.size())
     {
         if (!isPerfect()) throw std::runtime_error("Cannot merge into nonperfect tree.");
 
-        MerkleNodePtr<DBModelType> newRoot = std::make_shared<MerkleNode<DBModelType>>(*this, root);
-        newRoot->save(db);
+        holdRef(hash_, db);
+        MerkleNodePtr<DBModelType, HashPolicy> newRoot = create(pool_, *this, root);
+        newRoot->store(db);
         return newRoot;
     }
     else
     {
-        erase(db); // the original tree root is removed 
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        getChildren(db, leftChild, rightChild);
 
         // Recurse on right side
-        MerkleNodePtr<DBModelType> newRoot = getRightChild(db)->appendTree(root, db);
+        MerkleNodePtr<DBModelType, HashPolicy> newRoot = rightChild->appendTree(root, db);
 
         // Recurse on left side
-        newRoot = getLeftChild(db)->appendTree(*newRoot, db);
+        newRoot = leftChild->appendTree(*newRoot, db);
 
         return newRoot;
     }
 }
 
-template<typename DBModelType>
-MerkleNodePtr<DBModelType> MerkleNode<DBModelType>::removeItem(DBModelType& db)
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::removeItem(DBModelType& db)
 {
+    if (isLeaf()) return nullptr;
+
+    MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+    getChildren(db, leftChild, rightChild);
+
+    // The right spine is read before anything is written, so a pruned subtree on it throws with the batch untouched.
+    std::vector<MerkleNodePtr<DBModelType, HashPolicy>> rightLeftChildren;
+    while (rightChild->size() != 1)
+    {
+        MerkleNodePtr<DBModelType, HashPolicy> rightLeftChild, rightRightChild;
+        rightChild->getChildren(db, rightLeftChild, rightRightChild);
+        rightLeftChildren.push_back(rightLeftChild);
+        rightChild = rightRightChild;
+    }
+
+    holdRef(leftChild->hash(), db);
+    for (auto& rightLeftChild: rightLeftChildren)
+    {
+        holdRef(rightLeftChild->hash(), db);
+        leftChild = create(pool_, *leftChild, *rightLeftChild);
+        leftChild->store(db);
+    }
+
+    return leftChild;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MerkleNode<DBModelType, HashPolicy>::updateItem(uint64_t i, const bytes_t& data, DBModelType& db)
+{
+    if (i >= size_) throw std::runtime_error("Index exceeds tree size.");
+
+    MerkleNodePtr<DBModelType, HashPolicy> newNode = create(pool_);
     if (isLeaf())
     {
-        erase(db);
-        return nullptr;
+        newNode->setData(data);
     }
+    else
+    {
+        // Only the path to the item is rewritten, siblings are kept by hash.
+        newNode->size_ = size_;
+        newNode->leftChildHash_ = leftChildHash_;
+        newNode->rightChildHash_ = rightChildHash_;
+
+        uint64_t leftSize = this->leftSize();
+        if (i < leftSize)
+        {
+            newNode->setLeftChildHash(getLeftChild(db)->updateItem(i, data, db)->hash());
+            holdRef(rightChildHash_, db);
+        }
+        else
+        {
+            newNode->setRightChildHash(getRightChild(db)->updateItem(i - leftSize, data, db)->hash());
+            holdRef(leftChildHash_, db);
+        }
+    }
+    newNode->store(db);
+    return newNode;
+}
 
-    erase(db);
-    MerkleNodePtr<DBModelType> leftChild = getLeftChild(db);
-    MerkleNodePtr<DBModelType> rightChild = getRightChild(db);
-    while (rightChild->size() != 1)
+template<typename DBModelType, typename HashPolicy>
+void MerkleNode<DBModelType, HashPolicy>::updateHash()
+{
+    const size_t DIGEST_SIZE = HashPolicy::DIGEST_SIZE;
+    const size_t TAG_SIZE = HashPolicy::DOMAIN_TAGS ? 1 : 0;
+    const unsigned char tag = isLeaf() ? LEAF_TAG : NODE_TAG;
+    size_t len = TAG_SIZE + leftChildHash_.size() + data_.size() + rightChildHash_.size();
+
+    hash_.resize(DIGEST_SIZE);
+    if (data_.empty() && leftChildHash_.size() == DIGEST_SIZE && rightChildHash_.size() == DIGEST_SIZE)
+    {
+        // Interior nodes hash a fixed size message on the stack.
+        unsigned char m[1 + 2 * DIGEST_SIZE];
+        m[0] = tag;
+        std::memcpy(m + TAG_SIZE, &leftChildHash_[0], DIGEST_SIZE);
+        std::memcpy(m + TAG_SIZE + DIGEST_SIZE, &rightChildHash_[0], DIGEST_SIZE);
+        HashPolicy::hash(m, len, &hash_[0]);
+    }
+    else
+    {
+        // Reuse one message buffer per thread rather than allocating for every leaf.
+        static thread_local bytes_t m;
+        m.clear();
+        if (TAG_SIZE) { m.push_back(tag); }
+        m.insert(m.end(), leftChildHash_.begin(), leftChildHash_.end());
+        m.insert(m.end(), data_.begin(), data_.end());
+        m.insert(m.end(), rightChildHash_.begin(), rightChildHash_.end());
+        HashPolicy::hash(m.data(), m.size(), &hash_[0]);
+    }
+
+    nodeStats().hashes.add();
+    nodeStats().hashBytes.add(len);
+}
+
+// In-order iteration over the leaves with indices in [from, to). The cursor descends to the first leaf keeping
+// the right siblings it passes on a stack. Subtrees of at most readAhead leaves are then loaded a whole level at
+// a time, ahead of the cursor, instead of one child lookup per step.
+template<typename DBModelType, typename HashPolicy = Sha256HashPolicy>
+class MMRLeafIterator
+{
+public:
+    MMRLeafIterator(const DBModelType& db, const MerkleNodePtr<DBModelType, HashPolicy>& root, uint64_t from, uint64_t to, uint64_t readAhead);
+
+    bool valid() const { return !leaves_.empty(); }
+    void next();
+
+    uint64_t index() const { return index_; }
+    const MerkleNodePtr<DBModelType, HashPolicy>& node() const { return leaves_.front(); }
+    const bytes_t& data() const;
+
+private:
+    typedef std::pair<MerkleNodePtr<DBModelType, HashPolicy>, uint64_t> subtree_t; // subtree root and index of its first leaf
+
+    const DBModelType& db_;
+    uint64_t index_;
+    uint64_t to_;
+    uint64_t readAhead_;
+
+    std::vector<subtree_t> stack_;
+    std::deque<MerkleNodePtr<DBModelType, HashPolicy>> leaves_;
+
+    void seek(subtree_t subtree, uint64_t from);
+    void loadLeaves(const subtree_t& subtree, uint64_t from);
+};
+
+template<typename DBModelType, typename HashPolicy>
+MMRLeafIterator<DBModelType, HashPolicy>::MMRLeafIterator(const DBModelType& db, const MerkleNodePtr<DBModelType, HashPolicy>& root, uint64_t from, uint64_t to, uint64_t readAhead)
+    : db_(db), index_(from), to_(to), readAhead_(readAhead ? readAhead : 1)
+{
+    if (!root) return;
+    if (to_ > root->size()) { to_ = root->size(); }
+    if (from >= to_) return;
+
+    seek(subtree_t(root, 0), from);
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRLeafIterator<DBModelType, HashPolicy>::next()
+{
+    if (leaves_.empty()) throw std::runtime_error("Iterator is not valid.");
+
+    leaves_.pop_front();
+    index_++;
+
+    if (leaves_.empty() && !stack_.empty())
     {
+        subtree_t subtree = stack_.back();
+        stack_.pop_back();
+        seek(subtree, subtree.second);
+    }
+}
 
-        leftChild = std::make_shared<MerkleNode<DBModelType>>(*leftChild, *rightChild->getLeftChild(db));
-        leftChild->save(db);
+// Leaf data is only needed once the cursor reaches it, and is then loaded for all the leaves read ahead.
+template<typename DBModelType, typename HashPolicy>
+const bytes_t& MMRLeafIterator<DBModelType, HashPolicy>::data() const
+{
+    if (leaves_.empty()) throw std::runtime_error("Iterator is not valid.");
 
-        rightChild = rightChild->getRightChild(db);
-        rightChild->erase(db);
+    const MerkleNodePtr<DBModelType, HashPolicy>& leaf = leaves_.front();
+    if (!leaf->isDataLoaded())
+    {
+        std::vector<MerkleNodePtr<DBModelType, HashPolicy>> leaves(leaves_.begin(), leaves_.end());
+        MerkleNode<DBModelType, HashPolicy>::loadData(leaves, db_);
     }
+    return leaf->data();
+}
 
-    return leftChild;
+template<typename DBModelType, typename HashPolicy>
+void MMRLeafIterator<DBModelType, HashPolicy>::seek(subtree_t subtree, uint64_t from)
+{
+    while (subtree.first->size() > readAhead_)
+    {
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        subtree.first->getChildren(db_, leftChild, rightChild);
+        uint64_t rightStart = subtree.second + leftChild->size();
+        if (from < rightStart)
+        {
+            if (rightStart < to_) { stack_.push_back(subtree_t(rightChild, rightStart)); }
+            subtree = subtree_t(leftChild, subtree.second);
+        }
+        else
+        {
+            subtree = subtree_t(rightChild, rightStart);
+        }
+    }
+
+    loadLeaves(subtree, from);
 }
 
-template<typename DBModelType>
-void MerkleNode<DBModelType>::updateHash()
+template<typename DBModelType, typename HashPolicy>
+void MMRLeafIterator<DBModelType, HashPolicy>::loadLeaves(const subtree_t& subtree, uint64_t from)
 {
-    uchar_vector m;
-    m += leftChildHash_;
-    m += data_;
-    m += rightChildHash_;
-    hash_ = sha256(m);
+    // Expand the subtree one level at a time with a single lookup per level, dropping nodes that lie entirely outside [from, to).
+    std::vector<subtree_t> level(1, subtree);
+    while (true)
+    {
+        std::vector<MerkleNodePtr<DBModelType, HashPolicy>> parents;
+        for (auto& node: level)
+        {
+            if (node.second >= to_ || node.second + node.first->size() <= from) continue;
+            if (!node.first->isLeaf()) { parents.push_back(node.first); }
+        }
+        if (parents.empty()) break;
+
+        std::vector<MerkleNodePtr<DBModelType, HashPolicy>> children = MerkleNode<DBModelType, HashPolicy>::getChildren(parents, db_);
+        std::vector<subtree_t> nextLevel;
+        size_t i = 0;
+        for (auto& node: level)
+        {
+            if (node.second >= to_ || node.second + node.first->size() <= from) continue;
+
+            if (node.first->isLeaf())
+            {
+                nextLevel.push_back(node);
+                continue;
+            }
+
+            const MerkleNodePtr<DBModelType, HashPolicy>& leftChild = children[i++];
+            const MerkleNodePtr<DBModelType, HashPolicy>& rightChild = children[i++];
+            nextLevel.push_back(subtree_t(leftChild, node.second));
+            nextLevel.push_back(subtree_t(rightChild, node.second + leftChild->size()));
+        }
+        level.swap(nextLevel);
+    }
+
+    for (auto& node: level)
+    {
+        if (node.second >= from && node.second < to_) { leaves_.push_back(node.first); }
+    }
+}
+
+// Outcome of MMRTree::verify. When several nodes are corrupt, the one with the lowest leaf index is reported,
+// ancestors before their descendants.
+class MMRVerifyResult
+{
+public:
+    MMRVerifyResult() : nodesChecked(0), corrupt(false), index(0), size(0) { }
+
+    uint64_t nodesChecked;
+
+    bool corrupt;
+    uint64_t index;     // index of the corrupt node's first leaf
+    uint64_t size;      // number of leaves the node should have
+    bytes_t hash;       // key the node is stored under
+    std::string error;
+
+    std::string json() const;
+};
+
+inline std::string MMRVerifyResult::json() const
+{
+    std::stringstream ss;
+    ss << "{\"nodesChecked\":" << nodesChecked << ","
+       << "\"corrupt\":" << (corrupt ? "true" : "false");
+    if (corrupt)
+    {
+        ss << ",\"index\":" << index << ","
+           << "\"size\":" << size << ","
+           << "\"hash\":\"" << uchar_vector(hash).getHex() << "\","
+           << "\"error\":\"" << error << "\"";
+    }
+    ss << "}";
+    return ss.str();
+}
+
+// Inclusion proof for one leaf: its data and the hashes of the siblings along its path, starting next to the leaf.
+// The path itself follows from the index and the tree size.
+class MMRProof
+{
+public:
+    MMRProof() : index(0), size(0) { }
+
+    uint64_t index;
+    uint64_t size;      // number of leaves in the tree
+    bytes_t data;
+    std::vector<bytes_t> siblings;
+
+    std::string json() const;
+};
+
+inline std::string MMRProof::json() const
+{
+    std::stringstream ss;
+    ss << "{\"index\":" << index << ","
+       << "\"size\":" << size << ","
+       << "\"data\":\"" << uchar_vector(data).getHex() << "\","
+       << "\"siblings\":[";
+    for (size_t i = 0; i < siblings.size(); i++)
+    {
+        if (i > 0) { ss << ","; }
+        ss << "\"" << uchar_vector(siblings[i]).getHex() << "\"";
+    }
+    ss << "]}";
+    return ss.str();
 }
 
-template<typename DBModelType>
+template<typename DBModelType, typename HashPolicy = Sha256HashPolicy>
 class MMRTree
 {
 public:
-    explicit MMRTree(const std::string& dbname);
-    virtual ~MMRTree() { db_.close(); }
+    explicit MMRTree(const std::string& dbname, const DBOptions& options = DBOptions());
+    virtual ~MMRTree();
 
-    const MerkleNodePtr<DBModelType>& root() const { return root_; }
-    const bytes_t& rootHash() const { return root_ ? root_->hash() : EMPTY_BYTES; }
+    const DBModelType& db() const { return db_; }
+    DBModelType& db() { return db_; }
+
+    // The root and root hash include pending appends, which are hashed on the way.
+    const MerkleNodePtr<DBModelType, HashPolicy>& root() const { hashPending(); return root_; }
+    const bytes_t& rootHash() const { hashPending(); return root_ ? root_->hash() : EMPTY_BYTES; }
     uint64_t size() const { return root_ ? root_->size() : 0; }
 
+    // With deferred hashing, appends add pending nodes in memory, neither hashed nor stored, and the nodes an
+    // append replaces are dropped without ever being hashed. Pending nodes are hashed in one pass when the root
+    // hash, the root or a proof is requested, and stored by flush(), which commit() and every other update call
+    // first. Reads walk pending nodes in memory, except verify(), which reads stored nodes only and throws if any
+    // are pending. Turning deferral off flushes. Reading the root hash is not thread safe while appends are pending.
+    void setDeferredHashing(bool defer);
+    bool defersHashing() const { return deferHashing_; }
+    bool hasPending() const { return root_ != storedRoot_; }
+    void flush();
+
     // Compute path to node with index i. False means left and true means right.
     std::vector<bool> path(uint64_t i) const;
 
     virtual void appendItem(const bytes_t& data);
     virtual void removeItem();
+    virtual void updateItem(uint64_t i, const bytes_t& data);
+
+    // Points the tree at a root whose nodes are already in the DB, freeing whatever only the old root used. An
+    // empty hash empties the tree.
+    void setRoot(const bytes_t& rootHash);
+
+    // Subtrees written before anything refers to them, such as the chunks of a snapshot import, hold no reference
+    // until their parents are stored. They are listed with the batch that writes them and the list is cleared with
+    // the batch that takes them over, so that freeUnrooted() can free whatever an interrupted writer left. Opening
+    // the tree frees any that are listed.
+    void batchAddUnrooted(const std::vector<bytes_t>& hashes);
+    void batchClearUnrooted() { db_.batchRemove(bytes_t(1, UNROOTED_KEY)); }
+    void freeUnrooted();
+
+    MerkleNodePtr<DBModelType, HashPolicy> getLeaf(uint64_t i) const;
+
+    // Only the nodes on the leaf's path are read, so proofs work for leaves next to pruned subtrees.
+    MMRProof proof(uint64_t i) const;
+    // The root hash a proof commits to. It matches rootHash() if the proof is valid for this tree.
+    static bytes_t proofRoot(const MMRProof& proof);
+
+    // Leaves with indices in [from, to), in order.
+    MMRLeafIterator<DBModelType, HashPolicy> items(uint64_t from = 0, uint64_t to = UINT64_MAX, uint64_t readAhead = 256) const { return MMRLeafIterator<DBModelType, HashPolicy>(db_, root_, from, to, readAhead); }
 
     virtual void commit();
     virtual void rollback();
 
-    virtual std::string json(const MerkleNodePtr<DBModelType>& root) const;
-    std::string json() const { return json(root_); }
+    virtual std::string json(const MerkleNodePtr<DBModelType, HashPolicy>& root) const;
+    std::string json() const;
+
+    // Checks every node under the root: its hash matches its key, its size matches its parent's split and interior
+    // nodes have both children. Subtrees are spread over a pool of the given number of threads (0 for one per core).
+    // progress is called on the calling thread with the number of nodes checked so far and the total. Leaf hashes
+    // are only checked against the leaf data if checkData is set, otherwise just the tree structure is read. Pruned
+    // subtrees are only checked for their size.
+    MMRVerifyResult verify(unsigned int threads = 0, const std::function<void(uint64_t checked, uint64_t total)>& progress = nullptr, bool checkData = true) const;
+
+    // Records the operations applied to the tree from now on, starting with a header for the current state. The
+    // recorder must outlive the tree or be detached with null.
+    void setTrace(TraceRecorder* trace);
+    TraceRecorder* trace() const { return trace_; }
+
+    // Node counters are kept by the tree's node pool, so they only count this tree's nodes.
+    MerkleNodePool<DBModelType, HashPolicy>* pool() const { return pool_; }
+    const MerkleTreeStats& stats() const { return stats_; }
+    const MerkleNodeStats& nodeStats() const { return pool_->stats(); }
+    const DBStats& dbStats() const { return db_.stats(); }
+    std::string statsJson() const { return "{\"tree\":" + stats().json() + ",\"nodes\":" + nodeStats().json() + ",\"pool\":" + pool_->json() + ",\"db\":" + dbStats().json() + "}"; }
 
 protected:
     DBModelType db_;
-    MerkleNodePtr<DBModelType> root_;
+    MerkleNodePool<DBModelType, HashPolicy>* pool_;
+    MerkleNodePtr<DBModelType, HashPolicy> root_;
+    TraceRecorder* trace_;
+    MerkleTreeStats stats_;
+
+    // Root whose reference the DB holds. It differs from root_ while appends are pending.
+    MerkleNodePtr<DBModelType, HashPolicy> storedRoot_;
+
+    // The root folds the peaks of the tree, its perfect subtrees from largest to smallest, from left to right.
+    // spine_[k] folds peaks_[0] to peaks_[k], so the last one is the root. Deferred appends merge and fold at the
+    // end of these in memory. They are loaded with the first deferred append after any other update.
+    bool deferHashing_;
+    std::vector<MerkleNodePtr<DBModelType, HashPolicy>> peaks_;
+    std::vector<MerkleNodePtr<DBModelType, HashPolicy>> spine_;
+
+    // Upper bound on nodes prefetched ahead of a full traversal.
+    static const uint64_t PREFETCH_NODES = 4096;
+
+    // Hashes of unrooted subtrees are stored back to back under UNROOTED_KEY.
+    enum { UNROOTED_KEY = 'u' };
+
+    // Subtrees with fewer leaves are verified by one task. Larger ones hand their right child to the pool.
+    static const uint64_t VERIFY_GRAIN = 4096;
+
+    void loadRoot();
+    void rebuildRefCounts(const bytes_t& rootHash);
+    void loadPeaks();
+    void appendPending(const bytes_t& data);
+    void hashPending() const { if (root_ && root_->hash().empty()) { MerkleNode<DBModelType, HashPolicy>::hashPending(root_); } }
+
+    // Trees that prune leaf data report leaves without it as pruned when verified rather than corrupt.
+    virtual bool prunesLeafData() const { return false; }
+
+    // Trees that collapse pruned subtrees report interior nodes without children as pruned rather than corrupt.
+    virtual bool prunesSubtrees() const { return false; }
+
+    // Makes root, which holds a reference for the tree, the new root and drops the reference to the old stored one.
+    void replaceRoot(const MerkleNodePtr<DBModelType, HashPolicy>& root);
 };
 
 
-template<typename DBModelType>
-MMRTree<DBModelType>::MMRTree(const std::string& dbname)
+template<typename DBModelType, typename HashPolicy>
+MMRTree<DBModelType, HashPolicy>::MMRTree(const std::string& dbname, const DBOptions& options)
+    : pool_(new MerkleNodePool<DBModelType, HashPolicy>()), trace_(nullptr), deferHashing_(false)
 {
-    db_.open(dbname);
+    db_.open(dbname, options);
     try
     {
-        bytes_t rootHash;
-        db_.get(bytes_t(), rootHash);
-        if (rootHash.empty()) return;
+        loadRoot();
+        freeUnrooted();
+    }
+    catch (...)
+    {
+        pool_->release();
+        throw;
+    }
+}
 
-        bytes_t serialized;
-        db_.get(rootHash, serialized);
-        root_ = std::make_shared<MerkleNode<DBModelType>>(serialized);
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::loadRoot()
+{
+    root_.reset();
+    storedRoot_.reset();
+    peaks_.clear();
+    spine_.clear();
+
+    bytes_t rootHash;
+    try
+    {
+        db_.get(bytes_t(), rootHash);
     }
     catch (...)
     {
+        // New database
         db_.insert(bytes_t(), bytes_t());
+        return;
+    }
+    if (rootHash.empty()) return;
+
+    // A root that does not load, for instance one written with another hash policy, must not be overwritten.
+    bytes_t serialized;
+    db_.get(rootHash, serialized);
+    MerkleNodePtr<DBModelType, HashPolicy> root = MerkleNode<DBModelType, HashPolicy>::createStored(pool_, rootHash, serialized);
+    if (root->hash() != rootHash) throw std::runtime_error("Root hash does not match the tree's hash policy.");
+    if (db_.refCount(rootHash) == 0) { rebuildRefCounts(rootHash); }
+    root_ = root;
+    storedRoot_ = root;
+}
+
+// Trees stored before reference counting hold no counts, so they are counted once from the root as one batch. Leaf
+// data still kept in leaf records moves to payload keys. Records the tree no longer reached are left as they are.
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::rebuildRefCounts(const bytes_t& rootHash)
+{
+    std::vector<bytes_t> hashes(1, rootHash);
+    while (!hashes.empty())
+    {
+        bytes_t hash = hashes.back();
+        hashes.pop_back();
+
+        // A node already counted is shared, so it takes another reference without being walked again.
+        bool counted = (db_.refCount(hash) > 0);
+        db_.batchAddRef(hash);
+        if (counted) continue;
+
+        bytes_t serialized;
+        db_.get(hash, serialized);
+        MerkleNodePtr<DBModelType, HashPolicy> node = MerkleNode<DBModelType, HashPolicy>::createStored(pool_, hash, serialized);
+        if (node->isLeaf())
+        {
+            if (node->isDataLoaded())
+            {
+                db_.batchInsert(hash, node->getStored());
+                db_.batchInsert(MerkleNode<DBModelType, HashPolicy>::payloadKey(hash), node->data());
+            }
+            continue;
+        }
+        hashes.push_back(node->rightChildHash());
+        hashes.push_back(node->leftChildHash());
+    }
+    db_.commit();
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::replaceRoot(const MerkleNodePtr<DBModelType, HashPolicy>& root)
+{
+    // The new tree holds references to whatever it shares with the old one, so only the rest is freed.
+    MerkleNodePtr<DBModelType, HashPolicy> oldRoot = storedRoot_;
+    root_ = root;
+    storedRoot_ = root;
+    peaks_.clear();
+    spine_.clear();
+    db_.batchInsert(bytes_t(), rootHash());
+    if (oldRoot) { MerkleNode<DBModelType, HashPolicy>::dropRef(oldRoot->hash(), db_, pool_); }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::setDeferredHashing(bool defer)
+{
+    if (!defer) { flush(); }
+    deferHashing_ = defer;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::flush()
+{
+    if (!hasPending()) return;
+
+    // Same as replaceRoot() except that the peaks stay loaded for the next append.
+    hashPending();
+    MerkleNode<DBModelType, HashPolicy>::storePending(root_, db_);
+    MerkleNodePtr<DBModelType, HashPolicy> oldRoot = storedRoot_;
+    storedRoot_ = root_;
+    db_.batchInsert(bytes_t(), root_->hash());
+    if (oldRoot) { MerkleNode<DBModelType, HashPolicy>::dropRef(oldRoot->hash(), db_, pool_); }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::loadPeaks()
+{
+    // The left spine of the root runs down to the first peak with the others hanging off it on the right.
+    MerkleNodePtr<DBModelType, HashPolicy> node = root_;
+    while (!node->isPerfect())
+    {
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        node->getChildren(db_, leftChild, rightChild);
+        spine_.push_back(node);
+        peaks_.push_back(rightChild);
+        node = leftChild;
+    }
+    spine_.push_back(node);
+    peaks_.push_back(node);
+    std::reverse(spine_.begin(), spine_.end());
+    std::reverse(peaks_.begin(), peaks_.end());
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::appendPending(const bytes_t& data)
+{
+    if (root_ && peaks_.empty()) { loadPeaks(); }
+
+    // Merge peaks of the same size like carries in a binary counter, then fold the new peak onto the spine.
+    MerkleNodePtr<DBModelType, HashPolicy> peak = MerkleNode<DBModelType, HashPolicy>::createPending(pool_, data);
+    while (!peaks_.empty() && peaks_.back()->size() == peak->size())
+    {
+        peak = MerkleNode<DBModelType, HashPolicy>::createPending(pool_, peaks_.back(), peak);
+        peaks_.pop_back();
+        spine_.pop_back();
     }
+    spine_.push_back(spine_.empty() ? peak : MerkleNode<DBModelType, HashPolicy>::createPending(pool_, spine_.back(), peak));
+    peaks_.push_back(peak);
+    root_ = spine_.back();
+}
+
+template<typename DBModelType, typename HashPolicy>
+MMRTree<DBModelType, HashPolicy>::~MMRTree()
+{
+    db_.close();
+
+    // Outstanding nodes keep the pool alive until they are released. Pending appends were never committed.
+    root_.reset();
+    storedRoot_.reset();
+    peaks_.clear();
+    spine_.clear();
+    pool_->release();
 }
 
 inline uint64_t msb64(uint64_t n)
@@ -386,10 +1503,10 @@ inline bool isNotPowerOf2(uint64_t n)
     return ((n == 0) || ((n & (~n + 1)) != n));
 }
 
-template<typename DBModelType>
-std::vector<bool> MMRTree<DBModelType>::path(uint64_t i) const
+// Path to leaf i of a tree with the given number of leaves. False means left and true means right.
+inline std::vector<bool> mmrPath(uint64_t i, uint64_t size)
 {
-    uint64_t nleft = size();
+    uint64_t nleft = size;
     if (i >= nleft) throw std::runtime_error("Index exceeds tree size.");
 
     std::vector<bool> rval;
@@ -424,46 +1541,254 @@ std::vector<bool> MMRTree<DBModelType>::path(uint64_t i) const
     return rval; 
 }
 
-template<typename DBModelType>
-void MMRTree<DBModelType>::appendItem(const bytes_t& data)
+template<typename DBModelType, typename HashPolicy>
+std::vector<bool> MMRTree<DBModelType, HashPolicy>::path(uint64_t i) const
 {
-    if (root_)
+    return mmrPath(i, size());
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::appendItem(const bytes_t& data)
+{
+    TraceScope trace(trace_);
+    if (trace)
+    {
+        TraceRecord record(TRACE_APPEND);
+        record.data = data;
+        trace->record(record);
+    }
+
+    StatTimer timer(stats_.appendLatency);
+    stats_.appends.add();
+
+    if (deferHashing_)
     {
-        root_ = root_->appendItem(data, db_);
-        db_.batchInsert(bytes_t(), root_->hash());
+        appendPending(data);
+    }
+    else if (root_)
+    {
+        replaceRoot(root_->appendItem(data, db_));
     }
     else
     {
-        root_ = std::make_shared<MerkleNode<DBModelType>>();
-        root_->setData(data);
-        root_->save(db_);
-        db_.batchInsert(bytes_t(), root_->hash());
+        MerkleNodePtr<DBModelType, HashPolicy> root = MerkleNode<DBModelType, HashPolicy>::create(pool_);
+        root->setData(data);
+        root->store(db_);
+        replaceRoot(root);
     }
 }
 
-template<typename DBModelType>
-void MMRTree<DBModelType>::removeItem()
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::removeItem()
 {
+    TraceScope trace(trace_);
+    if (trace) { trace->record(TraceRecord(TRACE_REMOVE)); }
+
     if (!root_) throw std::runtime_error("Tree is empty.");
 
-    root_ = root_->removeItem(db_);
-    db_.batchInsert(bytes_t(), rootHash());
+    StatTimer timer(stats_.removeLatency);
+    stats_.removes.add();
+
+    flush();
+    replaceRoot(root_->removeItem(db_));
 }
 
-template<typename DBModelType>
-void MMRTree<DBModelType>::commit()
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::commit()
 {
+    TraceScope trace(trace_);
+    if (trace)
+    {
+        TraceRecord record(TRACE_COMMIT);
+        record.data = rootHash();
+        trace->record(record);
+    }
+
+    flush();
+    stats_.commits.add();
     db_.commit();
 }
 
-template<typename DBModelType>
-void MMRTree<DBModelType>::rollback()
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::rollback()
 {
+    TraceScope trace(trace_);
+    if (trace) { trace->record(TraceRecord(TRACE_ROLLBACK)); }
+
     db_.rollback();
+    loadRoot();
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::updateItem(uint64_t i, const bytes_t& data)
+{
+    TraceScope trace(trace_);
+    if (trace)
+    {
+        TraceRecord record(TRACE_UPDATE);
+        record.index = i;
+        record.data = data;
+        trace->record(record);
+    }
+
+    if (i >= size()) throw std::runtime_error("Index exceeds tree size.");
+
+    flush();
+    replaceRoot(root_->updateItem(i, data, db_));
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::setRoot(const bytes_t& rootHash)
+{
+    flush();
+
+    MerkleNodePtr<DBModelType, HashPolicy> root;
+    if (!rootHash.empty())
+    {
+        bytes_t serialized;
+        db_.get(rootHash, serialized);
+        root = MerkleNode<DBModelType, HashPolicy>::createStored(pool_, rootHash, serialized);
+        if (root->hash() != rootHash) throw std::runtime_error("Root hash does not match the tree's hash policy.");
+        MerkleNode<DBModelType, HashPolicy>::holdRef(rootHash, db_);
+    }
+    replaceRoot(root);
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::batchAddUnrooted(const std::vector<bytes_t>& hashes)
+{
+    bytes_t list;
+    try
+    {
+        db_.get(bytes_t(1, UNROOTED_KEY), list);
+    }
+    catch (...)
+    {
+        list.clear();
+    }
+    for (auto& hash: hashes) { list.insert(list.end(), hash.begin(), hash.end()); }
+    db_.batchInsert(bytes_t(1, UNROOTED_KEY), list);
+}
+
+// Each subtree is held and then released, which frees it. All are held before any is released in case one subtree
+// is also part of another.
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::freeUnrooted()
+{
+    bytes_t list;
+    try
+    {
+        db_.get(bytes_t(1, UNROOTED_KEY), list);
+    }
+    catch (...)
+    {
+        return;
+    }
+    if (list.size() % HashPolicy::DIGEST_SIZE) throw std::runtime_error("Invalid unrooted subtree list.");
+
+    std::set<bytes_t> hashes;
+    for (size_t pos = 0; pos < list.size(); pos += HashPolicy::DIGEST_SIZE) { hashes.insert(bytes_t(list.begin() + pos, list.begin() + pos + HashPolicy::DIGEST_SIZE)); }
+    for (auto& hash: hashes) { MerkleNode<DBModelType, HashPolicy>::holdRef(hash, db_); }
+    for (auto& hash: hashes) { MerkleNode<DBModelType, HashPolicy>::dropRef(hash, db_, pool_); }
+    batchClearUnrooted();
+    db_.commit();
 }
 
-template<typename DBModelType>
-std::string MMRTree<DBModelType>::json(const MerkleNodePtr<DBModelType>& root) const
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> MMRTree<DBModelType, HashPolicy>::getLeaf(uint64_t i) const
+{
+    TraceScope trace(trace_);
+    if (trace)
+    {
+        TraceRecord record(TRACE_GET_LEAF);
+        record.index = i;
+        trace->record(record);
+    }
+
+    if (i >= size()) throw std::runtime_error("Index exceeds tree size.");
+
+    MerkleNodePtr<DBModelType, HashPolicy> node = root_;
+    while (!node->isLeaf())
+    {
+        uint64_t leftSize = node->leftSize();
+        if (i < leftSize)
+        {
+            node = node->getLeftChild(db_);
+        }
+        else
+        {
+            i -= leftSize;
+            node = node->getRightChild(db_);
+        }
+    }
+    return node;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void MMRTree<DBModelType, HashPolicy>::setTrace(TraceRecorder* trace)
+{
+    if (trace) { trace->begin(rootHash(), size()); }
+    trace_ = trace;
+}
+
+template<typename DBModelType, typename HashPolicy>
+MMRProof MMRTree<DBModelType, HashPolicy>::proof(uint64_t i) const
+{
+    if (i >= size()) throw std::runtime_error("Index exceeds tree size.");
+
+    MMRProof proof;
+    proof.index = i;
+    proof.size = size();
+    hashPending();
+
+    MerkleNodePtr<DBModelType, HashPolicy> node = root_;
+    while (!node->isLeaf())
+    {
+        uint64_t leftSize = node->leftSize();
+        if (i < leftSize)
+        {
+            proof.siblings.push_back(node->rightChildHash());
+            node = node->getLeftChild(db_);
+        }
+        else
+        {
+            i -= leftSize;
+            proof.siblings.push_back(node->leftChildHash());
+            node = node->getRightChild(db_);
+        }
+    }
+    proof.data = node->getData(db_);
+    std::reverse(proof.siblings.begin(), proof.siblings.end());
+    return proof;
+}
+
+template<typename DBModelType, typename HashPolicy>
+bytes_t MMRTree<DBModelType, HashPolicy>::proofRoot(const MMRProof& proof)
+{
+    std::vector<bool> path = mmrPath(proof.index, proof.size);
+    if (path.size() != proof.siblings.size()) throw std::runtime_error("Proof does not match the tree size.");
+
+    MerkleNode<DBModelType, HashPolicy> leaf;
+    leaf.setData(proof.data);
+    bytes_t hash = leaf.hash();
+    for (size_t i = 0; i < proof.siblings.size(); i++)
+    {
+        if (path[path.size() - 1 - i])  { hash = MerkleNode<DBModelType, HashPolicy>::parentHash(proof.siblings[i], hash); }
+        else                            { hash = MerkleNode<DBModelType, HashPolicy>::parentHash(hash, proof.siblings[i]); }
+    }
+    return hash;
+}
+
+template<typename DBModelType, typename HashPolicy>
+std::string MMRTree<DBModelType, HashPolicy>::json() const
+{
+    hashPending();
+    MerkleNode<DBModelType, HashPolicy>::prefetchSubtree(root_, db_, PREFETCH_NODES);
+    return json(root_);
+}
+
+template<typename DBModelType, typename HashPolicy>
+std::string MMRTree<DBModelType, HashPolicy>::json(const MerkleNodePtr<DBModelType, HashPolicy>& root) const
 {
     if (!root) return "null";
 
@@ -473,16 +1798,143 @@ std::string MMRTree<DBModelType>::json(const MerkleNodePtr<DBModelType>& root) c
        << "\"hash\":\"" << uchar_vector(root->hash()).getHex() << "\",";
     if (root->isLeaf())
     {
-        ss << "\"data\":\"" << uchar_vector(root->data()).getHex() << "\"";
+        ss << "\"data\":\"" << uchar_vector(root->getData(db_)).getHex() << "\"";
+    }
+    else if (root->isPruned())
+    {
+        ss << "\"pruned\":true";
     }
     else
     {
-        ss << "\"left\":" << json(root->getLeftChild(db_)) << ","
-           << "\"right\":" << json(root->getRightChild(db_));
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        root->getChildren(db_, leftChild, rightChild);
+        ss << "\"left\":" << json(leftChild) << ","
+           << "\"right\":" << json(rightChild);
     }
     ss << "}";
 
     return ss.str();
 }
 
+template<typename DBModelType, typename HashPolicy>
+MMRVerifyResult MMRTree<DBModelType, HashPolicy>::verify(unsigned int threads, const std::function<void(uint64_t checked, uint64_t total)>& progress, bool checkData) const
+{
+    MMRVerifyResult result;
+    if (!root_) return result;
+    if (hasPending()) throw std::runtime_error("Tree has appends that are not flushed.");
+
+    struct subtree_t
+    {
+        bytes_t hash;
+        uint64_t index;
+        uint64_t size;
+    };
+
+    std::atomic<uint64_t> checked(0);
+    std::atomic<uint64_t> firstCorrupt(UINT64_MAX);
+    std::mutex mutex; // guards result and pending
+    std::condition_variable done;
+    uint64_t pending = 0;
+
+    auto report = [&](const subtree_t& subtree, const std::string& error)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (result.corrupt && (subtree.index > result.index || (subtree.index == result.index && subtree.size <= result.size))) return;
+        result.corrupt = true;
+        result.index = subtree.index;
+        result.size = subtree.size;
+        result.hash = subtree.hash;
+        result.error = error;
+        firstCorrupt = subtree.index;
+    };
+
+    ThreadPool threadPool(threads ? threads : std::thread::hardware_concurrency());
+    std::function<void(const subtree_t&)> check;
+    auto spawn = [&](const subtree_t& subtree)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending++;
+        }
+        threadPool.submit([&check, subtree]() { check(subtree); });
+    };
+
+    check = [&](const subtree_t& top)
+    {
+        std::vector<subtree_t> stack(1, top);
+        while (!stack.empty())
+        {
+            subtree_t subtree = stack.back();
+            stack.pop_back();
+            if (subtree.index > firstCorrupt) continue;
+
+            MerkleNodePtr<DBModelType, HashPolicy> stored;
+            try
+            {
+                bytes_t serialized;
+                db_.get(subtree.hash, serialized);
+                stored = MerkleNode<DBModelType, HashPolicy>::createStored(pool_, subtree.hash, serialized);
+                if (checkData && stored->isLeaf() && !stored->isDataLoaded()
+                    && !(prunesLeafData() && !db_.exists(MerkleNode<DBModelType, HashPolicy>::payloadKey(subtree.hash))))
+                {
+                    // A leaf takes its key as its hash, so hash its data to check it.
+                    MerkleNodePtr<DBModelType, HashPolicy> leaf = MerkleNode<DBModelType, HashPolicy>::create(pool_);
+                    leaf->setData(stored->getData(db_));
+                    if (leaf->hash() != subtree.hash) { report(subtree, "Leaf hash does not match its data."); continue; }
+                }
+            }
+            catch (const std::exception& e)
+            {
+                report(subtree, e.what());
+                continue;
+            }
+            checked++;
+
+            const MerkleNode<DBModelType, HashPolicy>& node = *stored;
+            if (node.hash() != subtree.hash)    { report(subtree, "Node hash does not match its key."); continue; }
+            if (node.size() != subtree.size)    { report(subtree, "Node size does not match its parent."); continue; }
+            if (node.isLeaf())
+            {
+                if (!node.leftChildHash().empty() || !node.rightChildHash().empty()) { report(subtree, "Leaf has children."); }
+                continue;
+            }
+            if (node.isPruned() && prunesSubtrees())
+            {
+                if (!node.data().empty()) { report(subtree, "Interior node has data."); }
+                continue;
+            }
+            if (node.leftChildHash().empty() || node.rightChildHash().empty()) { report(subtree, "Interior node is missing a child."); continue; }
+            if (!node.data().empty()) { report(subtree, "Interior node has data."); continue; }
+
+            subtree_t leftChild = { node.leftChildHash(), subtree.index, node.leftSize() };
+            subtree_t rightChild = { node.rightChildHash(), subtree.index + node.leftSize(), node.size() - node.leftSize() };
+            if (rightChild.size >= VERIFY_GRAIN)    { spawn(rightChild); }
+            else                                    { stack.push_back(rightChild); }
+            stack.push_back(leftChild);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) { done.notify_all(); }
+    };
+
+    subtree_t root = { root_->hash(), 0, root_->size() };
+    spawn(root);
+
+    uint64_t total = 2 * root_->size() - 1;
+    const std::chrono::seconds progressInterval(1);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!done.wait_for(lock, progressInterval, [&]() { return pending == 0; }))
+    {
+        if (!progress) continue;
+        lock.unlock();
+        progress(checked, total);
+        lock.lock();
+    }
+    lock.unlock();
+    if (progress) { progress(checked, total); }
+
+    result.nodesChecked = checked;
+    return result;
+}
+
 }
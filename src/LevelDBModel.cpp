@@ -5,19 +5,142 @@ using namespace std;
 
 using namespace CryptoLedger;
 
+namespace CryptoLedger
+{
+
+// Merges committed keys with the pending batch. Pending inserts shadow committed values and pending removals hide them.
+class LevelDBIterator : public DBIterator
+{
+public:
+    LevelDBIterator(Iterator* it, const map<bytes_t, bytes_t>& insertionMap, const set<bytes_t>& removalSet, const bytes_t& from, const bytes_t& to);
+    ~LevelDBIterator() { delete it_; }
+
+    bool valid() const { return valid_; }
+    void next();
+
+    const bytes_t& key() const { return key_; }
+    const bytes_t& value() const { return value_; }
+
+private:
+    Iterator* it_;
+    map<bytes_t, bytes_t>::const_iterator mapIt_;
+    map<bytes_t, bytes_t>::const_iterator mapEnd_;
+    const set<bytes_t>& removalSet_;
+    bytes_t to_;
+
+    bool valid_;
+    bool fromMap_;
+    bytes_t key_;
+    bytes_t value_;
+
+    bool inRange(const bytes_t& key) const { return to_.empty() || key < to_; }
+    void skipRemoved();
+    void update();
+};
+
+}
+
+LevelDBIterator::LevelDBIterator(Iterator* it, const map<bytes_t, bytes_t>& insertionMap, const set<bytes_t>& removalSet, const bytes_t& from, const bytes_t& to)
+    : it_(it), mapIt_(insertionMap.lower_bound(from)), mapEnd_(to.empty() ? insertionMap.end() : insertionMap.lower_bound(to)), removalSet_(removalSet), to_(to)
+{
+    it_->Seek(Slice(reinterpret_cast<const char*>(from.data()), from.size()));
+    skipRemoved();
+    update();
+}
+
+void LevelDBIterator::next()
+{
+    if (!valid_) throw runtime_error("Iterator is not valid.");
+
+    if (fromMap_)
+    {
+        // A pending insert shadows the committed value for the same key.
+        if (it_->Valid() && it_->key() == Slice(reinterpret_cast<const char*>(key_.data()), key_.size())) { it_->Next(); }
+        ++mapIt_;
+    }
+    else
+    {
+        it_->Next();
+    }
+
+    skipRemoved();
+    update();
+}
+
+void LevelDBIterator::skipRemoved()
+{
+    while (it_->Valid())
+    {
+        bytes_t key(it_->key().data(), it_->key().data() + it_->key().size());
+        if (!removalSet_.count(key)) break;
+        it_->Next();
+    }
+}
+
+void LevelDBIterator::update()
+{
+    if (!it_->status().ok()) throw runtime_error(it_->status().ToString());
+
+    bool dbValid = false;
+    if (it_->Valid())
+    {
+        key_.assign(it_->key().data(), it_->key().data() + it_->key().size());
+        dbValid = inRange(key_);
+    }
+    bool mapValid = (mapIt_ != mapEnd_);
+
+    valid_ = dbValid || mapValid;
+    if (!valid_) return;
+
+    fromMap_ = mapValid && (!dbValid || !(key_ < mapIt_->first));
+    if (fromMap_)
+    {
+        key_ = mapIt_->first;
+        value_ = mapIt_->second;
+    }
+    else
+    {
+        value_.assign(it_->value().data(), it_->value().data() + it_->value().size());
+    }
+}
+
 LevelDBModel::~LevelDBModel()
 {
     close();
 }
 
-void LevelDBModel::open(const string& dbname)
+void LevelDBModel::open(const string& dbname, const DBOptions& dbOptions)
 {
     if (db_) throw runtime_error("DB is already open.");
 
     Options options;
     options.create_if_missing = true;
+    options.write_buffer_size = dbOptions.writeBufferSize;
+    options.max_open_files = dbOptions.maxOpenFiles;
+    options.block_size = dbOptions.blockSize;
+    options.compression = dbOptions.compression ? kSnappyCompression : kNoCompression;
+    if (dbOptions.blockCacheSize)
+    {
+        blockCache_ = NewLRUCache(dbOptions.blockCacheSize);
+        options.block_cache = blockCache_;
+    }
+    if (dbOptions.bloomFilterBits)
+    {
+        filterPolicy_ = NewBloomFilterPolicy(dbOptions.bloomFilterBits);
+        options.filter_policy = filterPolicy_;
+    }
+
+    writeOptions_.sync = dbOptions.syncWrites;
+    scanOptions_.fill_cache = dbOptions.fillCacheOnScan;
+    prefetchCacheSize_ = dbOptions.prefetchCacheSize;
+    if (dbOptions.ioThreads) { ioPool_.reset(new ThreadPool(dbOptions.ioThreads)); }
+
     Status status = DB::Open(options, dbname, &db_);
-    if (!status.ok()) throw runtime_error(status.ToString()); 
+    if (!status.ok())
+    {
+        close();
+        throw runtime_error(status.ToString()); 
+    }
 }
 
 void LevelDBModel::close()
@@ -27,13 +150,31 @@ void LevelDBModel::close()
         delete db_;
         db_ = nullptr;
     }
+
+    ioPool_.reset();
+    prefetched_.clear();
+    prefetchOrder_.clear();
+
+    // The cache and filter policy must outlive the DB.
+    if (blockCache_)
+    {
+        delete blockCache_;
+        blockCache_ = nullptr;
+    }
+
+    if (filterPolicy_)
+    {
+        delete filterPolicy_;
+        filterPolicy_ = nullptr;
+    }
 }
 
 void LevelDBModel::insert(const bytes_t& key, const bytes_t& value)
 {
     if (!db_) throw runtime_error("DB is not open.");
 
-    Status status = db_->Put(WriteOptions(), Slice(string(reinterpret_cast<const char*>(&key[0]), key.size())), Slice(string(reinterpret_cast<const char*>(&value[0]), value.size())));
+    evict(key);
+    Status status = db_->Put(writeOptions_, Slice(string(reinterpret_cast<const char*>(&key[0]), key.size())), Slice(string(reinterpret_cast<const char*>(&value[0]), value.size())));
     if (!status.ok()) throw runtime_error(status.ToString()); 
 }
 
@@ -41,7 +182,8 @@ void LevelDBModel::remove(const bytes_t& key)
 {
     if (!db_) throw runtime_error("DB is not open.");
 
-    Status status = db_->Delete(WriteOptions(), Slice(string(reinterpret_cast<const char*>(&key[0]), key.size())));
+    evict(key);
+    Status status = db_->Delete(writeOptions_, Slice(string(reinterpret_cast<const char*>(&key[0]), key.size())));
     if (!status.ok()) throw runtime_error(status.ToString()); 
 }
 
@@ -49,9 +191,26 @@ void LevelDBModel::get(const bytes_t& key, bytes_t& value) const
 {
     if (!db_) throw runtime_error("DB is not open.");
 
+    StatTimer timer(stats_.getLatency);
+    stats_.gets.add();
+
+    if (removalSet_.count(key)) throw runtime_error("NotFound: ");
+
     auto it = insertionMap_.find(key);
     if (it == insertionMap_.end())
     {
+        {
+            lock_guard<mutex> lock(prefetchMutex_);
+            auto cached = prefetched_.find(key);
+            if (cached != prefetched_.end())
+            {
+                value = useCached(cached);
+                stats_.prefetchHits.add();
+                stats_.getBytes.add(value.size());
+                return;
+            }
+        }
+
         string strvalue;
         Status status = db_->Get(ReadOptions(), Slice(string(reinterpret_cast<const char*>(&key[0]), key.size())), &strvalue);
         if (!status.ok()) throw runtime_error(status.ToString());
@@ -62,33 +221,284 @@ void LevelDBModel::get(const bytes_t& key, bytes_t& value) const
     {
         value = it->second;
     }
+
+    stats_.getBytes.add(value.size());
+}
+
+bool LevelDBModel::exists(const bytes_t& key) const
+{
+    if (!db_) throw runtime_error("DB is not open.");
+
+    if (removalSet_.count(key)) return false;
+    if (insertionMap_.count(key)) return true;
+    {
+        lock_guard<mutex> lock(prefetchMutex_);
+        if (prefetched_.count(key)) return true;
+    }
+
+    string strvalue;
+    Status status = db_->Get(ReadOptions(), Slice(reinterpret_cast<const char*>(key.data()), key.size()), &strvalue);
+    if (status.IsNotFound()) return false;
+    if (!status.ok()) throw runtime_error(status.ToString());
+    return true;
+}
+
+void LevelDBModel::multiGet(const vector<bytes_t>& keys, vector<bytes_t>& values) const
+{
+    if (!db_) throw runtime_error("DB is not open.");
+
+    StatTimer timer(stats_.multiGetLatency);
+    stats_.multiGets.add();
+
+    // Pending updates and prefetched values are resolved here, the rest is read from the DB in parallel.
+    values.assign(keys.size(), bytes_t());
+    vector<size_t> pending;
+    vector<bytes_t> pendingKeys;
+    {
+        lock_guard<mutex> lock(prefetchMutex_);
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (removalSet_.count(keys[i])) throw runtime_error("NotFound: ");
+
+            auto it = insertionMap_.find(keys[i]);
+            if (it != insertionMap_.end())
+            {
+                values[i] = it->second;
+                continue;
+            }
+
+            auto cached = prefetched_.find(keys[i]);
+            if (cached != prefetched_.end())
+            {
+                values[i] = useCached(cached);
+                stats_.prefetchHits.add();
+                continue;
+            }
+
+            pending.push_back(i);
+            pendingKeys.push_back(keys[i]);
+        }
+    }
+
+    vector<bytes_t> pendingValues;
+    vector<bool> found;
+    readCommitted(pendingKeys, pendingValues, found);
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        if (!found[i]) throw runtime_error("NotFound: ");
+        values[pending[i]].swap(pendingValues[i]);
+    }
+
+    stats_.gets.add(keys.size());
+    for (auto& value: values) { stats_.getBytes.add(value.size()); }
+}
+
+void LevelDBModel::prefetch(const vector<bytes_t>& keys) const
+{
+    if (!db_) throw runtime_error("DB is not open.");
+    if (!prefetchCacheSize_) return;
+
+    vector<bytes_t> pendingKeys;
+    {
+        lock_guard<mutex> lock(prefetchMutex_);
+        for (auto& key: keys)
+        {
+            if (!insertionMap_.count(key) && !removalSet_.count(key) && !prefetched_.count(key)) { pendingKeys.push_back(key); }
+        }
+    }
+    if (pendingKeys.empty()) return;
+
+    vector<bytes_t> values;
+    vector<bool> found;
+    readCommitted(pendingKeys, values, found);
+
+    lock_guard<mutex> lock(prefetchMutex_);
+    for (size_t i = 0; i < pendingKeys.size(); i++)
+    {
+        if (found[i]) { cacheValue(pendingKeys[i], values[i]); }
+    }
+
+    stats_.prefetchedKeys.add(pendingKeys.size());
+}
+
+void LevelDBModel::prefetch(const vector<bytes_t>& keys, vector<bytes_t>& values) const
+{
+    if (!db_) throw runtime_error("DB is not open.");
+
+    // Pending updates and cached values are resolved here, the rest is read from the DB once and cached.
+    values.assign(keys.size(), bytes_t());
+    vector<size_t> pending;
+    vector<bytes_t> pendingKeys;
+    {
+        lock_guard<mutex> lock(prefetchMutex_);
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (removalSet_.count(keys[i])) continue;
+
+            auto it = insertionMap_.find(keys[i]);
+            if (it != insertionMap_.end())
+            {
+                values[i] = it->second;
+                continue;
+            }
+
+            auto cached = prefetched_.find(keys[i]);
+            if (cached != prefetched_.end())
+            {
+                values[i] = useCached(cached);
+                continue;
+            }
+
+            pending.push_back(i);
+            pendingKeys.push_back(keys[i]);
+        }
+    }
+    if (pendingKeys.empty()) return;
+
+    vector<bytes_t> pendingValues;
+    vector<bool> found;
+    readCommitted(pendingKeys, pendingValues, found);
+
+    lock_guard<mutex> lock(prefetchMutex_);
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        if (!found[i]) continue;
+
+        values[pending[i]] = pendingValues[i];
+        if (prefetchCacheSize_) { cacheValue(pendingKeys[i], pendingValues[i]); }
+    }
+
+    stats_.prefetchedKeys.add(pendingKeys.size());
+}
+
+void LevelDBModel::readCommitted(const vector<bytes_t>& keys, vector<bytes_t>& values, vector<bool>& found) const
+{
+    values.assign(keys.size(), bytes_t());
+    found.assign(keys.size(), false);
+
+    // vector<bool> packs bits, so each range reports through its own flags.
+    vector<char> foundFlags(keys.size(), 0);
+    auto readRange = [&](uint64_t begin, uint64_t end)
+    {
+        string strvalue;
+        for (uint64_t i = begin; i < end; i++)
+        {
+            Status status = db_->Get(ReadOptions(), Slice(reinterpret_cast<const char*>(keys[i].data()), keys[i].size()), &strvalue);
+            if (status.IsNotFound()) continue;
+            if (!status.ok()) throw runtime_error(status.ToString());
+
+            values[i].assign(strvalue.begin(), strvalue.end());
+            foundFlags[i] = 1;
+        }
+    };
+
+    if (ioPool_ && keys.size() > 1)     { ioPool_->parallel(keys.size(), readRange); }
+    else                                { readRange(0, keys.size()); }
+
+    for (size_t i = 0; i < keys.size(); i++) { found[i] = foundFlags[i]; }
+}
+
+// Marks a cached value as most recently used. Called with prefetchMutex_ held.
+const bytes_t& LevelDBModel::useCached(map<bytes_t, PrefetchEntry>::iterator cached) const
+{
+    prefetchOrder_.splice(prefetchOrder_.end(), prefetchOrder_, cached->second.order);
+    return cached->second.value;
+}
+
+// Takes value into the cache, evicting the least recently used entries to make room. Called with prefetchMutex_
+// held.
+void LevelDBModel::cacheValue(const bytes_t& key, bytes_t& value) const
+{
+    // Another reader may have cached the key since it was checked.
+    auto cached = prefetched_.find(key);
+    if (cached != prefetched_.end())
+    {
+        cached->second.value.swap(value);
+        useCached(cached);
+        return;
+    }
+
+    while (prefetched_.size() >= prefetchCacheSize_ && !prefetchOrder_.empty())
+    {
+        prefetched_.erase(prefetchOrder_.front());
+        prefetchOrder_.pop_front();
+    }
+
+    PrefetchEntry& entry = prefetched_[key];
+    entry.value.swap(value);
+    entry.order = prefetchOrder_.insert(prefetchOrder_.end(), key);
+}
+
+void LevelDBModel::evict(const bytes_t& key)
+{
+    lock_guard<mutex> lock(prefetchMutex_);
+    auto cached = prefetched_.find(key);
+    if (cached == prefetched_.end()) return;
+
+    prefetchOrder_.erase(cached->second.order);
+    prefetched_.erase(cached);
 }
 
 void LevelDBModel::batchInsert(const bytes_t& key, const bytes_t& value)
 {
+    evict(key);
     insertionMap_[key] = value;
+    removalSet_.erase(key);
     updates_.Put(Slice(string(reinterpret_cast<const char*>(&key[0]), key.size())), Slice(string(reinterpret_cast<const char*>(&value[0]), value.size())));
+
+    stats_.batchInserts.add();
+    stats_.batchInsertBytes.add(key.size() + value.size());
+    pendingBytes_.add(key.size() + value.size());
+    pendingOps_.add();
 }
 
 void LevelDBModel::batchRemove(const bytes_t& key)
 {
+    evict(key);
     insertionMap_.erase(key);
+    removalSet_.insert(key);
     updates_.Delete(Slice(string(reinterpret_cast<const char*>(&key[0]), key.size())));
+
+    stats_.batchRemoves.add();
+    pendingBytes_.add(key.size());
+    pendingOps_.add();
 }
 
 void LevelDBModel::commit()
 {
     if (!db_) throw runtime_error("DB is not open.");
 
-    Status status = db_->Write(WriteOptions(), &updates_);
-    if (!status.ok()) throw runtime_error(status.ToString());
+    {
+        StatTimer timer(stats_.commitLatency);
+        Status status = db_->Write(writeOptions_, &updates_);
+        if (!status.ok()) throw runtime_error(status.ToString());
+    }
+
+    stats_.commits.add();
+    stats_.commitBytes.add(pendingBytes_.value());
+    stats_.commitBatchSize.record(pendingBytes_.value());
+    stats_.commitBatchOps.record(pendingOps_.value());
+    pendingBytes_.reset();
+    pendingOps_.reset();
 
     insertionMap_.clear();
+    removalSet_.clear();
+    updates_.Clear();
 }
 
 void LevelDBModel::rollback()
 {
     insertionMap_.clear();
+    removalSet_.clear();
     updates_.Clear();
+
+    pendingBytes_.reset();
+    pendingOps_.reset();
 }
 
+DBIteratorPtr LevelDBModel::newIterator(const bytes_t& from, const bytes_t& to) const
+{
+    if (!db_) throw runtime_error("DB is not open.");
+
+    return DBIteratorPtr(new LevelDBIterator(db_->NewIterator(scanOptions_), insertionMap_, removalSet_, from, to));
+}
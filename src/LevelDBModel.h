@@ -1,11 +1,18 @@
 #pragma once
 
 #include "DBModel.h"
+#include "ThreadPool.h"
 
 #include <leveldb/db.h>
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
 #include <leveldb/write_batch.h>
 
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <stdexcept>
 
 namespace CryptoLedger
@@ -14,16 +21,21 @@ namespace CryptoLedger
 class LevelDBModel : public DBModel
 {
 public:
-    LevelDBModel() : DBModel(), db_(nullptr) { }
+    LevelDBModel() : DBModel(), db_(nullptr), blockCache_(nullptr), filterPolicy_(nullptr), prefetchCacheSize_(0) { }
     ~LevelDBModel();
 
-    void open(const std::string& dbname);
+    void open(const std::string& dbname, const DBOptions& options = DBOptions());
     void close();
     bool isOpen() const { return (db_ != nullptr); }
 
     void insert(const bytes_t& key, const bytes_t& value);
     void remove(const bytes_t& key);
     void get(const bytes_t& key, bytes_t& value) const;
+    bool exists(const bytes_t& key) const;
+
+    void multiGet(const std::vector<bytes_t>& keys, std::vector<bytes_t>& values) const;
+    void prefetch(const std::vector<bytes_t>& keys) const;
+    void prefetch(const std::vector<bytes_t>& keys, std::vector<bytes_t>& values) const;
 
     void batchInsert(const bytes_t& key, const bytes_t& value);
     void batchRemove(const bytes_t& key);
@@ -31,10 +43,41 @@ public:
     void commit();
     void rollback();
 
+    DBIteratorPtr newIterator(const bytes_t& from, const bytes_t& to) const;
+
 private:
     leveldb::DB* db_;
+    leveldb::Cache* blockCache_;
+    const leveldb::FilterPolicy* filterPolicy_;
+    leveldb::WriteOptions writeOptions_;
+    leveldb::ReadOptions scanOptions_;
+
     leveldb::WriteBatch updates_;
     std::map<bytes_t, bytes_t> insertionMap_;
+    std::set<bytes_t> removalSet_;
+
+    std::unique_ptr<ThreadPool> ioPool_;
+
+    // Committed values loaded by prefetch, evicted least recently used first. Each entry holds its place in
+    // prefetchOrder_, so reads and evictions move or drop it in place. Guarded by prefetchMutex_.
+    struct PrefetchEntry
+    {
+        bytes_t value;
+        std::list<bytes_t>::iterator order;
+    };
+    size_t prefetchCacheSize_;
+    mutable std::map<bytes_t, PrefetchEntry> prefetched_;
+    mutable std::list<bytes_t> prefetchOrder_;
+    mutable std::mutex prefetchMutex_;
+
+    void readCommitted(const std::vector<bytes_t>& keys, std::vector<bytes_t>& values, std::vector<bool>& found) const;
+    const bytes_t& useCached(std::map<bytes_t, PrefetchEntry>::iterator cached) const;
+    void cacheValue(const bytes_t& key, bytes_t& value) const;
+    void evict(const bytes_t& key);
+
+    // Size of the pending write batch, for stats only.
+    StatCounter pendingBytes_;
+    StatCounter pendingOps_;
 };
 
 }
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "Stats.h"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace CryptoLedger
+{
+
+// Smart pointer for objects that carry their own reference count through addRef() and release().
+template<typename T>
+class IntrusivePtr
+{
+public:
+    IntrusivePtr() : p_(nullptr) { }
+    IntrusivePtr(std::nullptr_t) : p_(nullptr) { }
+    explicit IntrusivePtr(T* p) : p_(p) { if (p_) p_->addRef(); }
+    IntrusivePtr(const IntrusivePtr& other) : p_(other.p_) { if (p_) p_->addRef(); }
+    IntrusivePtr(IntrusivePtr&& other) : p_(other.p_) { other.p_ = nullptr; }
+    ~IntrusivePtr() { if (p_) p_->release(); }
+
+    IntrusivePtr& operator=(const IntrusivePtr& other)
+    {
+        if (other.p_) other.p_->addRef();
+        if (p_) p_->release();
+        p_ = other.p_;
+        return *this;
+    }
+
+    IntrusivePtr& operator=(IntrusivePtr&& other)
+    {
+        if (this != &other)
+        {
+            if (p_) p_->release();
+            p_ = other.p_;
+            other.p_ = nullptr;
+        }
+        return *this;
+    }
+
+    void reset() { if (p_) p_->release(); p_ = nullptr; }
+
+    T* get() const { return p_; }
+    T& operator*() const { return *p_; }
+    T* operator->() const { return p_; }
+    explicit operator bool() const { return p_ != nullptr; }
+
+    bool operator==(const IntrusivePtr& other) const { return p_ == other.p_; }
+    bool operator!=(const IntrusivePtr& other) const { return p_ != other.p_; }
+
+private:
+    T* p_;
+};
+
+// Pools without counters of their own for the objects they hand out.
+class NoObjectStats { };
+
+// Free list of recycled objects. Recycled objects keep their buffers, so reinitializing them rarely allocates.
+// The pool is itself reference counted: every object it hands out holds a reference, so it outlives its owner
+// until the last object is returned. Objects record their own counters in the pool's Stats, which are then per
+// owner rather than per process.
+template<typename T, typename Stats = NoObjectStats>
+class ObjectPool
+{
+public:
+    explicit ObjectPool(size_t maxPooled = 65536) : refs_(1), maxPooled_(maxPooled) { }
+
+    // Returns a recycled object if one is available. The caller reinitializes it.
+    T* acquire();
+    void recycle(T* object);
+
+    void addRef() { refs_.fetch_add(1, std::memory_order_relaxed); }
+    void release() { if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this; }
+
+    size_t pooled() const;
+    std::string json() const;
+
+    Stats& stats() { return stats_; }
+    const Stats& stats() const { return stats_; }
+
+private:
+    ~ObjectPool() { for (auto object: free_) { delete object; } }
+
+    std::atomic<uint32_t> refs_;
+    size_t maxPooled_;
+    std::vector<T*> free_;
+    mutable std::mutex mutex_;
+
+    StatCounter allocations_;
+    StatCounter reuses_;
+    StatCounter recycles_;
+
+    Stats stats_;
+};
+
+template<typename T, typename Stats>
+T* ObjectPool<T, Stats>::acquire()
+{
+    addRef();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty())
+        {
+            T* object = free_.back();
+            free_.pop_back();
+            reuses_.add();
+            return object;
+        }
+    }
+
+    allocations_.add();
+    return new T();
+}
+
+template<typename T, typename Stats>
+void ObjectPool<T, Stats>::recycle(T* object)
+{
+    bool pooled = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.size() < maxPooled_)
+        {
+            free_.push_back(object);
+            pooled = true;
+        }
+    }
+    if (pooled) { recycles_.add(); }
+    else        { delete object; }
+
+    release();
+}
+
+template<typename T, typename Stats>
+size_t ObjectPool<T, Stats>::pooled() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return free_.size();
+}
+
+template<typename T, typename Stats>
+std::string ObjectPool<T, Stats>::json() const
+{
+    std::stringstream ss;
+    ss << "{\"enabled\":" << (STATS_ENABLED ? "true" : "false") << ","
+       << "\"allocations\":" << statJson(allocations_) << ","
+       << "\"reuses\":" << statJson(reuses_) << ","
+       << "\"recycles\":" << statJson(recycles_) << ","
+       << "\"pooled\":" << pooled() << "}";
+    return ss.str();
+}
+
+}
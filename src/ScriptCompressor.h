@@ -0,0 +1,147 @@
+#pragma once
+
+#include <CoinCore/typedefs.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include <stdint.h>
+
+// Compact encoding for output scripts. Standard templates are stored as a type byte followed by the hash or key
+// they commit to. Anything else is stored raw as a type byte, a length and the script.
+//
+// Length encoding: lengths below 0xfd take one byte. Longer ones are 0xfd, 0xfe or 0xff followed by a 2, 4 or 8
+// byte big endian length.
+
+namespace CryptoLedger
+{
+
+class ScriptCompressor
+{
+public:
+    enum Type
+    {
+        RAW     = 0x00,
+        P2PKH   = 0x01, // OP_DUP OP_HASH160 <20> OP_EQUALVERIFY OP_CHECKSIG
+        P2SH    = 0x02, // OP_HASH160 <20> OP_EQUAL
+        P2WPKH  = 0x03, // OP_0 <20>
+        P2WSH   = 0x04, // OP_0 <32>
+        P2TR    = 0x05, // OP_1 <32>
+        P2PK    = 0x06  // <33 byte compressed key> OP_CHECKSIG
+    };
+
+    static Type type(const bytes_t& script);
+
+    static void compress(const bytes_t& script, bytes_t& compressed);
+
+    // Reads one compressed script starting at pos and advances pos past it.
+    static bytes_t decompress(const bytes_t& compressed, uint64_t& pos);
+
+private:
+    struct Template
+    {
+        Type type;
+        size_t prefixSize;
+        unsigned char prefix[3];
+        size_t payloadSize;
+        size_t suffixSize;
+        unsigned char suffix[2];
+    };
+
+    static const Template* findTemplate(Type type);
+};
+
+inline const ScriptCompressor::Template* ScriptCompressor::findTemplate(Type type)
+{
+    static const Template templates[] =
+    {
+        { P2PKH,  3, { 0x76, 0xa9, 0x14 }, 20, 2, { 0x88, 0xac } },
+        { P2SH,   2, { 0xa9, 0x14 },       20, 1, { 0x87 } },
+        { P2WPKH, 2, { 0x00, 0x14 },       20, 0, { } },
+        { P2WSH,  2, { 0x00, 0x20 },       32, 0, { } },
+        { P2TR,   2, { 0x51, 0x20 },       32, 0, { } },
+        { P2PK,   1, { 0x21 },             33, 1, { 0xac } }
+    };
+
+    for (auto& t: templates)
+    {
+        if (t.type == type) return &t;
+    }
+    return nullptr;
+}
+
+inline ScriptCompressor::Type ScriptCompressor::type(const bytes_t& script)
+{
+    for (int i = P2PKH; i <= P2PK; i++)
+    {
+        const Template& t = *findTemplate((Type)i);
+        if (script.size() != t.prefixSize + t.payloadSize + t.suffixSize) continue;
+        if (std::memcmp(&script[0], t.prefix, t.prefixSize) != 0) continue;
+        if (t.suffixSize > 0 && std::memcmp(&script[t.prefixSize + t.payloadSize], t.suffix, t.suffixSize) != 0) continue;
+
+        // Only compressed keys fit the P2PK template.
+        if (t.type == P2PK && script[1] != 0x02 && script[1] != 0x03) continue;
+        return t.type;
+    }
+    return RAW;
+}
+
+inline void ScriptCompressor::compress(const bytes_t& script, bytes_t& compressed)
+{
+    Type t = type(script);
+    compressed.push_back(t);
+    if (t != RAW)
+    {
+        const Template* tmpl = findTemplate(t);
+        compressed.insert(compressed.end(), script.begin() + tmpl->prefixSize, script.begin() + tmpl->prefixSize + tmpl->payloadSize);
+        return;
+    }
+
+    uint64_t len = script.size();
+    int lenbytes = 0;
+    if (len < 0xfd)             { compressed.push_back(len); }
+    else if (len <= 0xffff)     { compressed.push_back(0xfd); lenbytes = 2; }
+    else if (len <= 0xffffffff) { compressed.push_back(0xfe); lenbytes = 4; }
+    else                        { compressed.push_back(0xff); lenbytes = 8; }
+    for (int i = lenbytes - 1; i >= 0; i--) { compressed.push_back((len >> (8 * i)) & 0xff); }
+    compressed.insert(compressed.end(), script.begin(), script.end());
+}
+
+inline bytes_t ScriptCompressor::decompress(const bytes_t& compressed, uint64_t& pos)
+{
+    if (compressed.size() < pos + 1) throw std::runtime_error("Invalid compressed script.");
+
+    // The tag is checked before it is taken as a Type, which only has values for the known types.
+    unsigned char tag = compressed[pos++];
+    if (tag > P2PK) throw std::runtime_error("Unknown script type.");
+    Type t = (Type)tag;
+
+    if (t != RAW)
+    {
+        const Template* tmpl = findTemplate(t);
+        if (compressed.size() - pos < tmpl->payloadSize) throw std::runtime_error("Invalid compressed script.");
+
+        bytes_t script(tmpl->prefix, tmpl->prefix + tmpl->prefixSize);
+        script.insert(script.end(), compressed.begin() + pos, compressed.begin() + pos + tmpl->payloadSize);
+        script.insert(script.end(), tmpl->suffix, tmpl->suffix + tmpl->suffixSize);
+        pos += tmpl->payloadSize;
+        return script;
+    }
+
+    if (compressed.size() < pos + 1) throw std::runtime_error("Invalid compressed script.");
+    uint64_t len = compressed[pos++];
+    int lenbytes = (len == 0xfd) ? 2 : (len == 0xfe) ? 4 : (len == 0xff) ? 8 : 0;
+    if (lenbytes > 0)
+    {
+        if (compressed.size() - pos < (uint64_t)lenbytes) throw std::runtime_error("Invalid compressed script.");
+        len = 0;
+        for (int i = 0; i < lenbytes; i++) { len = (len << 8) | compressed[pos++]; }
+    }
+
+    if (compressed.size() - pos < len) throw std::runtime_error("Invalid compressed script.");
+    bytes_t script(compressed.begin() + pos, compressed.begin() + pos + len);
+    pos += len;
+    return script;
+}
+
+}
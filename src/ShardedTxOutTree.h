@@ -0,0 +1,227 @@
+#pragma once
+
+#include "TxOutTree.h"
+#include "ThreadPool.h"
+
+#include <memory>
+#include <sstream>
+
+namespace CryptoLedger
+{
+
+class OutPoint
+{
+public:
+    OutPoint(const bytes_t& txhash, uint32_t txindex) : txhash_(txhash), txindex_(txindex) { }
+
+    const bytes_t& txhash() const { return txhash_; }
+    uint32_t txindex() const { return txindex_; }
+
+private:
+    bytes_t txhash_;
+    uint32_t txindex_;
+};
+
+class TxOut
+{
+public:
+    TxOut(const bytes_t& txhash, uint32_t txindex, const TxOutItem& txout) : outpoint_(txhash, txindex), txout_(txout) { }
+
+    const OutPoint& outpoint() const { return outpoint_; }
+    const TxOutItem& txout() const { return txout_; }
+
+private:
+    OutPoint outpoint_;
+    TxOutItem txout_;
+};
+
+// Partitions outputs by transaction hash across independent TxOutTrees, each with its own database at
+// <dbname>.shard<i>. Blocks are applied to all shards in parallel. The root commits to the shard roots in order.
+// The database at <dbname> records the shard count and the root as of the last commit. Opening a ledger whose shard
+// roots do not match that root, as left by a commit interrupted between shards, throws.
+template<typename DBModelType, typename HashPolicy = Sha256HashPolicy>
+class ShardedTxOutTree
+{
+public:
+    ShardedTxOutTree(const std::string& dbname, unsigned int shards, unsigned int threads = 0, const DBOptions& options = DBOptions());
+    ~ShardedTxOutTree() { meta_.close(); }
+
+    unsigned int shardCount() const { return shards_.size(); }
+    unsigned int shardOf(const bytes_t& txhash) const;
+    TxOutTree<DBModelType, HashPolicy>& shard(unsigned int i) { return *shards_[i]; }
+    const TxOutTree<DBModelType, HashPolicy>& shard(unsigned int i) const { return *shards_[i]; }
+
+    // Outputs are appended before spends are applied, so a block may spend its own outputs. If this throws, the
+    // block may be partially applied and should be rolled back.
+    void applyBlock(const std::vector<TxOut>& appends, const std::vector<OutPoint>& spends);
+
+    TxOutItem getItem(const bytes_t& txhash, uint32_t txindex) const { return shards_[shardOf(txhash)]->getItem(txhash, txindex); }
+
+    // Each block is one commit, so spent outputs are pruned depth blocks later. See TxOutTree.
+    void setPruning(uint64_t depth, bool collapse = false) { for (auto& shard: shards_) { shard->setPruning(depth, collapse); } }
+    void setDeferredHashing(bool defer) { for (auto& shard: shards_) { shard->setDeferredHashing(defer); } }
+
+    void commit();
+    void rollback();
+
+    bytes_t rootHash() const;
+    const bytes_t& committedRootHash() const { return committedRootHash_; }
+    uint64_t size() const;
+
+    std::string json() const;
+
+private:
+    DBModelType meta_;
+    std::vector<std::unique_ptr<TxOutTree<DBModelType, HashPolicy>>> shards_;
+    ThreadPool threadPool_;
+    bytes_t committedRootHash_;
+
+    void forEachShard(const std::function<void(unsigned int)>& f);
+};
+
+template<typename DBModelType, typename HashPolicy>
+ShardedTxOutTree<DBModelType, HashPolicy>::ShardedTxOutTree(const std::string& dbname, unsigned int shards, unsigned int threads, const DBOptions& options)
+    : threadPool_(threads ? threads : shards)
+{
+    if (shards == 0 || shards > 0xffff) throw std::runtime_error("Invalid shard count.");
+
+    meta_.open(dbname, options);
+
+    // Outputs cannot be repartitioned, so the shard count is fixed when the ledger is created.
+    bytes_t shardCountKey(1, 's');
+    bytes_t shardCount;
+    try
+    {
+        meta_.get(shardCountKey, shardCount);
+    }
+    catch (...)
+    {
+        // New ledger
+        shardCount.push_back(shards >> 8);
+        shardCount.push_back(shards & 0xff);
+        meta_.insert(shardCountKey, shardCount);
+    }
+    if (shardCount.size() != 2 || (((unsigned int)shardCount[0] << 8) | shardCount[1]) != shards) throw std::runtime_error("Shard count does not match the ledger.");
+
+    try
+    {
+        meta_.get(bytes_t(1, 'r'), committedRootHash_);
+    }
+    catch (...)
+    {
+        committedRootHash_.clear();
+    }
+
+    for (unsigned int i = 0; i < shards; i++)
+    {
+        std::stringstream ss;
+        ss << dbname << ".shard" << i;
+        shards_.push_back(std::unique_ptr<TxOutTree<DBModelType, HashPolicy>>(new TxOutTree<DBModelType, HashPolicy>(ss.str(), options)));
+    }
+
+    if (!committedRootHash_.empty() && rootHash() != committedRootHash_) throw std::runtime_error("Shard roots do not match the committed root. A commit was interrupted.");
+}
+
+template<typename DBModelType, typename HashPolicy>
+unsigned int ShardedTxOutTree<DBModelType, HashPolicy>::shardOf(const bytes_t& txhash) const
+{
+    // Rehash so that the partition stays balanced even for txhashes that are not uniformly distributed.
+    unsigned char digest[FastHashPolicy::DIGEST_SIZE];
+    FastHashPolicy::hash(txhash.data(), txhash.size(), digest);
+    uint64_t n = 0;
+    for (int i = 0; i < 8; i++) { n = (n << 8) | digest[i]; }
+    return n % shards_.size();
+}
+
+template<typename DBModelType, typename HashPolicy>
+void ShardedTxOutTree<DBModelType, HashPolicy>::forEachShard(const std::function<void(unsigned int)>& f)
+{
+    std::vector<std::future<void>> futures;
+    for (unsigned int i = 0; i < shards_.size(); i++)
+    {
+        futures.push_back(threadPool_.submit([&f, i]() { f(i); }));
+    }
+
+    for (auto& future: futures) { future.wait(); }
+    for (auto& future: futures) { future.get(); }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void ShardedTxOutTree<DBModelType, HashPolicy>::applyBlock(const std::vector<TxOut>& appends, const std::vector<OutPoint>& spends)
+{
+    std::vector<std::vector<const TxOut*>> shardAppends(shards_.size());
+    for (auto& txout: appends) { shardAppends[shardOf(txout.outpoint().txhash())].push_back(&txout); }
+
+    std::vector<std::vector<const OutPoint*>> shardSpends(shards_.size());
+    for (auto& outpoint: spends) { shardSpends[shardOf(outpoint.txhash())].push_back(&outpoint); }
+
+    forEachShard([&](unsigned int i)
+    {
+        TxOutTree<DBModelType, HashPolicy>& tree = *shards_[i];
+        for (auto txout: shardAppends[i]) { tree.appendItem(txout->outpoint().txhash(), txout->outpoint().txindex(), txout->txout()); }
+        for (auto outpoint: shardSpends[i]) { tree.spendItem(outpoint->txhash(), outpoint->txindex()); }
+    });
+}
+
+template<typename DBModelType, typename HashPolicy>
+void ShardedTxOutTree<DBModelType, HashPolicy>::commit()
+{
+    forEachShard([this](unsigned int i) { shards_[i]->commit(); });
+
+    // A mismatch between the recorded root and the shard roots after a crash shows that a commit was interrupted.
+    committedRootHash_ = rootHash();
+    meta_.batchInsert(bytes_t(1, 'r'), committedRootHash_);
+    meta_.commit();
+}
+
+template<typename DBModelType, typename HashPolicy>
+void ShardedTxOutTree<DBModelType, HashPolicy>::rollback()
+{
+    forEachShard([this](unsigned int i) { shards_[i]->rollback(); });
+    meta_.rollback();
+}
+
+template<typename DBModelType, typename HashPolicy>
+bytes_t ShardedTxOutTree<DBModelType, HashPolicy>::rootHash() const
+{
+    // Empty shards contribute a zero digest so that every shard keeps its position.
+    bytes_t message;
+    for (auto& shard: shards_)
+    {
+        const bytes_t& shardRoot = shard->rootHash();
+        if (shardRoot.empty())  { message.insert(message.end(), HashPolicy::DIGEST_SIZE, 0); }
+        else                    { message.insert(message.end(), shardRoot.begin(), shardRoot.end()); }
+    }
+
+    bytes_t hash(HashPolicy::DIGEST_SIZE);
+    HashPolicy::hash(message.data(), message.size(), &hash[0]);
+    return hash;
+}
+
+template<typename DBModelType, typename HashPolicy>
+uint64_t ShardedTxOutTree<DBModelType, HashPolicy>::size() const
+{
+    uint64_t size = 0;
+    for (auto& shard: shards_) { size += shard->size(); }
+    return size;
+}
+
+template<typename DBModelType, typename HashPolicy>
+std::string ShardedTxOutTree<DBModelType, HashPolicy>::json() const
+{
+    std::stringstream ss;
+    ss << "{";
+    ss << "\"size\":" << size() << ","
+       << "\"hash\":\"" << uchar_vector(rootHash()).getHex() << "\","
+       << "\"shards\":[";
+    for (unsigned int i = 0; i < shards_.size(); i++)
+    {
+        if (i > 0) { ss << ","; }
+        ss << "{\"size\":" << shards_[i]->size() << ",\"hash\":\"" << uchar_vector(shards_[i]->rootHash()).getHex() << "\"}";
+    }
+    ss << "]}";
+
+    return ss.str();
+}
+
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <string>
+
+#include <stdint.h>
+
+// Instrumentation primitives. Counters and timers are only compiled in when CRYPTOLEDGER_STATS
+// is defined (make STATS=1). Otherwise they are empty inline classes and all calls compile away.
+
+namespace CryptoLedger
+{
+
+#ifdef CRYPTOLEDGER_STATS
+
+const bool STATS_ENABLED = true;
+
+class StatCounter
+{
+public:
+    StatCounter() : value_(0) { }
+
+    void add(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+    void reset() { value_.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_;
+};
+
+// Bucket i counts samples in the range [2^(i-1), 2^i). Bucket 0 counts zero samples.
+class StatHistogram
+{
+public:
+    static const unsigned int BUCKETS = 65;
+
+    StatHistogram() { reset(); }
+
+    void record(uint64_t sample);
+    void reset();
+
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t total() const { return total_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t bucket(unsigned int i) const { return buckets_[i].load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> buckets_[BUCKETS];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> max_;
+};
+
+inline void StatHistogram::record(uint64_t sample)
+{
+    unsigned int i = 0;
+    for (uint64_t n = sample; n > 0; n >>= 1) { i++; }
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(sample, std::memory_order_relaxed);
+
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (sample > max && !max_.compare_exchange_weak(max, sample, std::memory_order_relaxed)) { }
+}
+
+inline void StatHistogram::reset()
+{
+    for (unsigned int i = 0; i < BUCKETS; i++) { buckets_[i].store(0, std::memory_order_relaxed); }
+    count_.store(0, std::memory_order_relaxed);
+    total_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+// Records the nanoseconds elapsed between construction and destruction.
+class StatTimer
+{
+public:
+    explicit StatTimer(StatHistogram& histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) { }
+    ~StatTimer() { histogram_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count()); }
+
+private:
+    StatHistogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#else
+
+const bool STATS_ENABLED = false;
+
+class StatCounter
+{
+public:
+    void add(uint64_t /*n*/ = 1) { }
+    uint64_t value() const { return 0; }
+    void reset() { }
+};
+
+class StatHistogram
+{
+public:
+    static const unsigned int BUCKETS = 0;
+
+    void record(uint64_t /*sample*/) { }
+    void reset() { }
+
+    uint64_t count() const { return 0; }
+    uint64_t total() const { return 0; }
+    uint64_t max() const { return 0; }
+    uint64_t bucket(unsigned int /*i*/) const { return 0; }
+};
+
+class StatTimer
+{
+public:
+    explicit StatTimer(StatHistogram& /*histogram*/) { }
+};
+
+#endif
+
+inline std::string statJson(const StatCounter& counter)
+{
+    std::stringstream ss;
+    ss << counter.value();
+    return ss.str();
+}
+
+// Only nonempty buckets are listed, keyed by their upper bound.
+inline std::string statJson(const StatHistogram& histogram)
+{
+    std::stringstream ss;
+    ss << "{\"count\":" << histogram.count() << ","
+       << "\"total\":" << histogram.total() << ","
+       << "\"max\":" << histogram.max() << ","
+       << "\"buckets\":{";
+    bool first = true;
+    for (unsigned int i = 0; i < StatHistogram::BUCKETS; i++)
+    {
+        uint64_t n = histogram.bucket(i);
+        if (n == 0) continue;
+        if (!first) { ss << ","; }
+        ss << "\"" << (i == 0 ? 0 : (i == 64 ? UINT64_MAX : (uint64_t(1) << i) - 1)) << "\":" << n;
+        first = false;
+    }
+    ss << "}}";
+    return ss.str();
+}
+
+}
@@ -28,14 +28,49 @@ int main(int argc, char* argv[])
                 showPath(path);
                 return 0;
             }
-            
-            for (int i = 1; i < argc; i++)
+
+            if (string(argv[1]) == "i")
+            {
+                if (argc != 4) throw runtime_error("No item range specified for option i.");
+                uint64_t from = strtoull(argv[2], NULL, 0);
+                uint64_t to = strtoull(argv[3], NULL, 0);
+                for (auto it = tree.items(from, to); it.valid(); it.next())
+                {
+                    cout << it.index() << ": " << uchar_vector(it.data()).getHex() << endl;
+                }
+                return 0;
+            }
+
+            if (string(argv[1]) == "v")
+            {
+                unsigned int threads = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0;
+                MMRVerifyResult result = tree.verify(threads, [](uint64_t checked, uint64_t total)
+                {
+                    cerr << checked << "/" << total << " nodes checked." << endl;
+                });
+                cout << result.json() << endl;
+                return result.corrupt ? -1 : 0;
+            }
+
+            // Option s applies the remaining items and dumps stats instead of the tree. Option d applies them with
+            // deferred hashing.
+            bool showStats = (string(argv[1]) == "s");
+            bool deferHashing = (string(argv[1]) == "d");
+            tree.setDeferredHashing(deferHashing);
+
+            for (int i = (showStats || deferHashing ? 2 : 1); i < argc; i++)
             {
                 if (string(argv[i]) == "-") { tree.removeItem(); }
                 else                        { tree.appendItem(uchar_vector(argv[i])); }
             }
 
             tree.commit();
+
+            if (showStats)
+            {
+                cout << tree.statsJson() << endl;
+                return 0;
+            }
         }
 
         cout << tree.json() << endl;
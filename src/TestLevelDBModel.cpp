@@ -64,6 +64,21 @@ int main(int argc, char* argv[])
             dbModel.get(key, value);
             cout << value.getHex() << endl;
         }
+        else if (command == "scan")
+        {
+            if (argc > 4)
+            {
+                showHelp(argv[0]);
+                return -1;
+            }
+
+            uchar_vector prefix;
+            if (argc == 4) { prefix.setHex(argv[3]); }
+            for (DBIteratorPtr it = dbModel.newPrefixIterator(prefix); it->valid(); it->next())
+            {
+                cout << uchar_vector(it->key()).getHex() << " " << uchar_vector(it->value()).getHex() << endl;
+            }
+        }
         else
         {
             cerr << "Invalid command." << endl;
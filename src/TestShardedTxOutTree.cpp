@@ -0,0 +1,56 @@
+#include <iostream>
+
+#include "ShardedTxOutTree.h"
+#include "LevelDBModel.h"
+
+#include <stdutils/stringutils.h>
+
+using namespace CryptoLedger;
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        ShardedTxOutTree<LevelDBModel> tree("ShardedTxOutTree", 4);
+
+        if (argc > 1)
+        {
+            // Each argument is a txout to append or a spent outpoint given as s,<txhash>,<txindex>. All of them form one block.
+            vector<TxOut> appends;
+            vector<OutPoint> spends;
+            for (int i = 1; i < argc; i++)
+            {
+                vector<string> fields;
+                stdutils::explode(string(argv[i]), ',', back_inserter(fields));
+                if (fields.size() == 3 && fields[0] == "s")
+                {
+                    spends.push_back(OutPoint(uchar_vector(fields[1]), strtoul(fields[2].c_str(), NULL, 0)));
+                    continue;
+                }
+
+                if (fields.size() != 7) throw runtime_error("Invalid txout.");
+                uchar_vector txhash(fields[0]);
+                uint32_t txindex = strtoul(fields[1].c_str(), NULL, 0);
+                uint32_t version = strtoul(fields[2].c_str(), NULL, 0);
+                uint64_t height = strtoull(fields[3].c_str(), NULL, 0);
+                bool isCoinBase = (fields[4] == "true");
+                bool isSpent = (fields[5] == "true");
+                uchar_vector script(fields[6]);
+                appends.push_back(TxOut(txhash, txindex, TxOutItem(version, height, isCoinBase, isSpent, script)));
+            }
+
+            tree.applyBlock(appends, spends);
+            tree.commit();
+        }
+
+        cout << tree.json() << endl;
+    }
+    catch (const exception& e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return -2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+
+#include "TxOutTree.h"
+#include "LevelDBModel.h"
+
+using namespace CryptoLedger;
+using namespace std;
+
+class OpTiming
+{
+public:
+    OpTiming() : count(0), errors(0), totalNs(0), maxNs(0) { }
+
+    uint64_t count;
+    uint64_t errors;    // operations that threw, as they may have when recorded
+    uint64_t totalNs;
+    uint64_t maxNs;
+};
+
+template<typename DBModelType>
+void apply(TxOutTree<DBModelType>& tree, const TraceRecord& record)
+{
+    switch (record.op)
+    {
+    case TRACE_APPEND:          tree.appendItem(record.data); break;
+    case TRACE_REMOVE:          tree.removeItem(); break;
+    case TRACE_UPDATE:          tree.updateItem(record.index, record.data); break;
+    case TRACE_GET_LEAF:        tree.getLeaf(record.index); break;
+    case TRACE_COMMIT:          tree.commit(); break;
+    case TRACE_ROLLBACK:        tree.rollback(); break;
+    case TRACE_APPEND_TXOUT:    tree.appendItem(record.txhash, record.txindex, TxOutItem(record.data)); break;
+    case TRACE_SPEND_TXOUT:     tree.spendItem(record.txhash, record.txindex); break;
+    case TRACE_GET_TXOUT:       tree.getItem(record.txhash, record.txindex); break;
+    }
+}
+
+// Replays a trace against a tree stored with any DB model and prints the time taken by each kind of operation.
+// Fails if the root after a commit differs from the recorded one.
+template<typename DBModelType>
+int replay(istream& in, const string& dbname, const DBOptions& options)
+{
+    TraceReader reader(in);
+    TxOutTree<DBModelType> tree(dbname, options);
+    if (tree.rootHash() != reader.rootHash() || tree.size() != reader.size())
+    {
+        cerr << "Warning: The tree is not in the state the trace was recorded from." << endl;
+    }
+
+    map<TraceOp, OpTiming> timings;
+    uint64_t records = 0;
+    uint64_t diverged = 0;
+    TraceRecord record;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    while (reader.next(record))
+    {
+        OpTiming& timing = timings[record.op];
+        chrono::steady_clock::time_point opStart = chrono::steady_clock::now();
+        try
+        {
+            apply(tree, record);
+        }
+        catch (const exception&)
+        {
+            timing.errors++;
+        }
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - opStart).count();
+        timing.count++;
+        timing.totalNs += ns;
+        if (ns > timing.maxNs) { timing.maxNs = ns; }
+
+        if (record.op == TRACE_COMMIT && tree.rootHash() != record.data)
+        {
+            if (diverged == 0) { cerr << "Error: The root diverges from the trace at record " << records << "." << endl; }
+            diverged++;
+        }
+        records++;
+    }
+    uint64_t totalNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+    cout << "{\"records\":" << records << ","
+         << "\"totalNs\":" << totalNs << ","
+         << "\"divergedCommits\":" << diverged << ","
+         << "\"ops\":{";
+    bool first = true;
+    for (auto& item: timings)
+    {
+        if (!first) { cout << ","; }
+        first = false;
+        const OpTiming& timing = item.second;
+        cout << "\"" << traceOpName(item.first) << "\":{"
+             << "\"count\":" << timing.count << ","
+             << "\"errors\":" << timing.errors << ","
+             << "\"totalNs\":" << timing.totalNs << ","
+             << "\"meanNs\":" << (timing.totalNs / timing.count) << ","
+             << "\"maxNs\":" << timing.maxNs << "}";
+    }
+    cout << "},\"stats\":" << tree.statsJson() << "}" << endl;
+
+    return diverged ? -1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3 && argc != 4)
+    {
+        cerr << "Usage: " << argv[0] << " <trace> <db> [default|bulk|serving|lowmem]" << endl;
+        return -1;
+    }
+
+    try
+    {
+        DBOptions::Profile profile = DBOptions::DEFAULT;
+        if (argc == 4)
+        {
+            string name(argv[3]);
+            if (name == "bulk")             { profile = DBOptions::BULK_IMPORT; }
+            else if (name == "serving")     { profile = DBOptions::SERVING; }
+            else if (name == "lowmem")      { profile = DBOptions::LOW_MEMORY; }
+            else if (name != "default")     { throw runtime_error("Unknown DB profile."); }
+        }
+
+        ifstream in(argv[1], ios::binary);
+        if (!in) throw runtime_error("Failed to open trace file.");
+        return replay<LevelDBModel>(in, argv[2], DBOptions(profile));
+    }
+    catch (const exception& e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return -2;
+    }
+}
@@ -0,0 +1,117 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "TreeSync.h"
+#include "LevelDBModel.h"
+
+using namespace CryptoLedger;
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        if (argc == 5 && string(argv[1]) == "export")
+        {
+            MMRTree<LevelDBModel> source(argv[2]);
+            LevelDBModel target;
+            target.open(argv[3]);
+
+            ofstream out(argv[4], ios::binary);
+            if (!out) throw runtime_error("Failed to open node set file.");
+            cout << exportNodeSet(source, target, out) << " nodes exported." << endl;
+            return 0;
+        }
+
+        if (argc == 4 && string(argv[1]) == "import")
+        {
+            MMRTree<LevelDBModel> tree(argv[2]);
+
+            ifstream in(argv[3], ios::binary);
+            if (!in) throw runtime_error("Failed to open node set file.");
+            cout << importNodeSet(tree, in) << " nodes imported." << endl;
+            cout << tree.json() << endl;
+            return 0;
+        }
+
+        if (argc == 4 && string(argv[1]) == "snapshot")
+        {
+            MMRTree<LevelDBModel> tree(argv[2]);
+
+            ofstream out(argv[3], ios::binary);
+            if (!out) throw runtime_error("Failed to open snapshot file.");
+            cout << exportSnapshot(tree, out) << " leaves exported." << endl;
+            return 0;
+        }
+
+        if ((argc == 4 || argc == 5) && string(argv[1]) == "restore")
+        {
+            MMRTree<LevelDBModel> tree(argv[2], DBOptions(DBOptions::BULK_IMPORT));
+
+            ifstream in(argv[3], ios::binary);
+            if (!in) throw runtime_error("Failed to open snapshot file.");
+            unsigned int threads = (argc == 5) ? strtoul(argv[4], NULL, 0) : 0;
+            cout << importSnapshot(tree, in, threads) << " leaves imported." << endl;
+            cout << tree.json() << endl;
+            return 0;
+        }
+
+        if (argc == 3 && string(argv[1]) == "test")
+        {
+            // Subtrees that repeat in the source are exported once. Uses new databases named <db>.source, <db>.target
+            // and <db>.same.
+            string dbname(argv[2]);
+            MMRTree<LevelDBModel> source(dbname + ".source");
+            MMRTree<LevelDBModel> target(dbname + ".target");
+            MMRTree<LevelDBModel> same(dbname + ".same");
+            if (source.size() || target.size() || same.size()) throw runtime_error("Test databases are not empty.");
+
+            // Missing from the target: dd, its parent with cc, the two perfect subtrees above, 01, its parent and
+            // the root.
+            const unsigned char leaves[] = { 0xaa, 0xbb, 0xcc, 0xdd };
+            for (int i = 0; i < 3; i++) { target.appendItem(bytes_t(1, leaves[i])); }
+            for (int n = 0; n < 3; n++)
+            {
+                for (int i = 0; i < 4; i++) { source.appendItem(bytes_t(1, leaves[i])); }
+            }
+            source.appendItem(bytes_t(1, 0x01));
+            source.commit();
+            target.commit();
+
+            stringstream nodes;
+            uint64_t count = exportNodeSet(source, target.db(), nodes);
+            if (count != 7) throw runtime_error("Repeated subtrees were exported more than once.");
+            importNodeSet(target, nodes);
+            if (target.rootHash() != source.rootHash()) throw runtime_error("Imported node set does not rebuild the source root.");
+
+            // 2^k identical leaves need only one node per level.
+            LevelDBModel empty;
+            empty.open(dbname + ".empty");
+            for (int i = 0; i < 16; i++) { same.appendItem(bytes_t(1, 0xaa)); }
+            same.commit();
+            stringstream sameNodes;
+            if (exportNodeSet(same, empty, sameNodes) != 5) throw runtime_error("Identical subtrees were exported more than once.");
+
+            cout << "ok" << endl;
+            return 0;
+        }
+
+        if (argc == 3 && string(argv[1]) == "show")
+        {
+            MMRTree<LevelDBModel> tree(argv[2]);
+            cout << tree.json() << endl;
+            return 0;
+        }
+
+        cerr << "Usage: " << argv[0] << " export <source db> <target db> <file> | import <db> <file> | snapshot <db> <file> | restore <db> <file> [threads] | test <db> | show <db>" << endl;
+        return -1;
+    }
+    catch (const exception& e)
+    {
+        cerr << "Error: " << e.what() << endl;
+        return -2;
+    }
+
+    return 0;
+}
@@ -1,4 +1,6 @@
+#include <fstream>
 #include <iostream>
+#include <memory>
 
 #include "TxOutTree.h"
 #include "LevelDBModel.h"
@@ -30,14 +32,51 @@ int main(int argc, char* argv[])
                 showPath(path);
                 return 0;
             }
+
+            if (string(argv[1]) == "proof")
+            {
+                if (argc != 4) throw runtime_error("No outpoint specified for option proof.");
+                MMRProof proof = tree.proof(uchar_vector(argv[2]), strtoul(argv[3], NULL, 0));
+                cout << proof.json() << endl;
+                cout << (TxOutTree<LevelDBModel>::proofRoot(proof) == tree.rootHash() ? "valid" : "invalid") << endl;
+                return 0;
+            }
+
+            if (string(argv[1]) == "prune")
+            {
+                if (argc != 3 && argc != 4) throw runtime_error("No depth specified for option prune.");
+                tree.setPruning(strtoull(argv[2], NULL, 0), argc == 4 && string(argv[3]) == "collapse");
+                tree.commit();
+                return 0;
+            }
             
-            for (int i = 1; i < argc; i++)
+            // Option t <file> records the remaining items to a trace for build/tracereplay.
+            ofstream traceFile;
+            unique_ptr<TraceRecorder> trace;
+            bool recordTrace = (string(argv[1]) == "t");
+            if (recordTrace)
+            {
+                if (argc < 3) throw runtime_error("No trace file specified for option t.");
+                traceFile.open(argv[2], ios::binary);
+                if (!traceFile) throw runtime_error("Failed to open trace file.");
+                trace.reset(new TraceRecorder(traceFile));
+                tree.setTrace(trace.get());
+            }
+
+            // Each argument is a txout to append, - to remove the last one, or a spent outpoint given as
+            // s,<txhash>,<txindex>. All of them are committed together.
+            for (int i = (recordTrace ? 3 : 1); i < argc; i++)
             {
                 if (string(argv[i]) == "-") { tree.removeItem(); }
                 else
                 {
                     vector<string> txoutFields;
                     stdutils::explode(string(argv[i]), ',', back_inserter(txoutFields));
+                    if (txoutFields.size() == 3 && txoutFields[0] == "s")
+                    {
+                        tree.spendItem(uchar_vector(txoutFields[1]), strtoul(txoutFields[2].c_str(), NULL, 0));
+                        continue;
+                    }
                     if (txoutFields.size() != 7) throw runtime_error("Invalid txout.");
                     uchar_vector txhash(txoutFields[0]);
                     uint32_t txindex = strtoul(txoutFields[1].c_str(), NULL, 0);
@@ -51,6 +90,7 @@ int main(int argc, char* argv[])
             }
 
             tree.commit();
+            tree.setTrace(nullptr);
         }
 
         cout << tree.json() << endl;
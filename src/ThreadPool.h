@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace CryptoLedger
+{
+
+// Work-stealing pool. Each worker has its own deque: tasks submitted from a worker go to the front of that worker's
+// deque and are run newest first, while idle workers steal the oldest tasks from the back of other deques. Tasks
+// submitted from outside the pool are spread across the deques round-robin.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned int threads);
+    ~ThreadPool();
+
+    unsigned int size() const { return workers_.size(); }
+
+    std::future<void> submit(const std::function<void()>& task);
+
+    // Splits [0, n) into one range per thread and blocks until all ranges are done.
+    // The first exception thrown by a range is rethrown here.
+    void parallel(uint64_t n, const std::function<void(uint64_t begin, uint64_t end)>& f);
+
+private:
+    struct Queue
+    {
+        std::deque<std::packaged_task<void()>> tasks;
+        std::mutex mutex;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<uint64_t> queued_;
+    std::atomic<unsigned int> nextQueue_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stopping_;
+
+    // The pool and queue index of the calling thread if it is a worker.
+    static std::pair<const ThreadPool*, unsigned int>& currentWorker();
+
+    bool take(unsigned int i, std::packaged_task<void()>& task);
+    void run(unsigned int i);
+};
+
+inline ThreadPool::ThreadPool(unsigned int threads) : queued_(0), nextQueue_(0), stopping_(false)
+{
+    for (unsigned int i = 0; i < threads; i++) { queues_.push_back(std::unique_ptr<Queue>(new Queue())); }
+    for (unsigned int i = 0; i < threads; i++) { workers_.push_back(std::thread(&ThreadPool::run, this, i)); }
+}
+
+inline ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    condition_.notify_all();
+    for (auto& worker: workers_) { worker.join(); }
+}
+
+inline std::pair<const ThreadPool*, unsigned int>& ThreadPool::currentWorker()
+{
+    static thread_local std::pair<const ThreadPool*, unsigned int> worker(nullptr, 0);
+    return worker;
+}
+
+inline std::future<void> ThreadPool::submit(const std::function<void()>& task)
+{
+    std::packaged_task<void()> packagedTask(task);
+    std::future<void> future = packagedTask.get_future();
+    if (workers_.empty())
+    {
+        packagedTask();
+        return future;
+    }
+
+    unsigned int i = (currentWorker().first == this) ? currentWorker().second : (nextQueue_++ % queues_.size());
+    {
+        // Counted before it is published, so a worker taking the task never sees the count at zero.
+        std::lock_guard<std::mutex> lock(queues_[i]->mutex);
+        queued_++;
+        queues_[i]->tasks.push_front(std::move(packagedTask));
+    }
+    {
+        // Orders the count against a worker that checked it and is about to wait.
+        std::lock_guard<std::mutex> lock(mutex_);
+    }
+    condition_.notify_one();
+    return future;
+}
+
+inline void ThreadPool::parallel(uint64_t n, const std::function<void(uint64_t begin, uint64_t end)>& f)
+{
+    uint64_t chunks = workers_.empty() ? 1 : workers_.size();
+    if (chunks > n) { chunks = n; }
+    if (chunks <= 1)
+    {
+        if (n > 0) { f(0, n); }
+        return;
+    }
+
+    std::vector<std::future<void>> futures;
+    for (uint64_t i = 0; i < chunks; i++)
+    {
+        uint64_t begin = n * i / chunks;
+        uint64_t end = n * (i + 1) / chunks;
+        futures.push_back(submit([&f, begin, end]() { f(begin, end); }));
+    }
+
+    for (auto& future: futures) { future.wait(); }
+    for (auto& future: futures) { future.get(); }
+}
+
+inline bool ThreadPool::take(unsigned int i, std::packaged_task<void()>& task)
+{
+    for (unsigned int n = 0; n < queues_.size(); n++)
+    {
+        Queue& queue = *queues_[(i + n) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+
+        if (n == 0)
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        else
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        queued_--;
+        return true;
+    }
+    return false;
+}
+
+inline void ThreadPool::run(unsigned int i)
+{
+    currentWorker() = std::make_pair(this, i);
+    while (true)
+    {
+        std::packaged_task<void()> task;
+        if (take(i, task))
+        {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+        if (stopping_ && queued_ == 0) return;
+    }
+}
+
+}
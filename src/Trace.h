@@ -0,0 +1,319 @@
+#pragma once
+
+#include <CoinCore/typedefs.h>
+
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+
+#include <stdint.h>
+
+// Workload traces record the operations applied to a tree so that they can be replayed offline, for instance by
+// build/tracereplay, against another build or DB model. Operations are recorded where they enter the tree; the
+// operations a TxOutTree makes on its MMRTree to carry out its own are not recorded separately.
+//
+// Trace format:
+//   magic "CLTR", version (1 byte)
+//   root (bytes), size (number)            - state of the tree when recording began
+//   records: operation (1 byte), fields
+//
+// Numbers and byte string lengths are encoded like script lengths: values below 0xfd take one byte, larger ones
+// are 0xfd, 0xfe or 0xff followed by 2, 4 or 8 bytes big endian.
+//
+// Record fields:
+//   APPEND         data
+//   REMOVE
+//   UPDATE         index, data
+//   GET_LEAF       index
+//   COMMIT         root after the commit
+//   ROLLBACK
+//   APPEND_TXOUT   txhash, txindex, serialized txout
+//   SPEND_TXOUT    txhash, txindex
+//   GET_TXOUT      txhash, txindex
+
+namespace CryptoLedger
+{
+
+const unsigned char TRACE_MAGIC[] = { 'C', 'L', 'T', 'R' };
+const unsigned char TRACE_VERSION = 1;
+
+enum TraceOp
+{
+    TRACE_APPEND        = 0x01,
+    TRACE_REMOVE        = 0x02,
+    TRACE_UPDATE        = 0x03,
+    TRACE_GET_LEAF      = 0x04,
+    TRACE_COMMIT        = 0x05,
+    TRACE_ROLLBACK      = 0x06,
+    TRACE_APPEND_TXOUT  = 0x07,
+    TRACE_SPEND_TXOUT   = 0x08,
+    TRACE_GET_TXOUT     = 0x09
+};
+
+inline const char* traceOpName(TraceOp op)
+{
+    switch (op)
+    {
+    case TRACE_APPEND:          return "append";
+    case TRACE_REMOVE:          return "remove";
+    case TRACE_UPDATE:          return "update";
+    case TRACE_GET_LEAF:        return "getLeaf";
+    case TRACE_COMMIT:          return "commit";
+    case TRACE_ROLLBACK:        return "rollback";
+    case TRACE_APPEND_TXOUT:    return "appendTxOut";
+    case TRACE_SPEND_TXOUT:     return "spendTxOut";
+    case TRACE_GET_TXOUT:       return "getTxOut";
+    }
+    return "unknown";
+}
+
+// One operation. Fields the operation does not have are left empty.
+class TraceRecord
+{
+public:
+    TraceRecord(TraceOp op_ = TRACE_APPEND) : op(op_), index(0), txindex(0) { }
+
+    TraceOp op;
+    uint64_t index;
+    bytes_t data;       // leaf data, serialized txout or root after a commit
+    bytes_t txhash;
+    uint32_t txindex;
+};
+
+// Writes records to a stream. The stream is flushed with each commit so that a trace cut short ends on a commit.
+// Records may come from several threads.
+class TraceRecorder
+{
+public:
+    explicit TraceRecorder(std::ostream& out) : out_(out), begun_(false), records_(0) { }
+
+    // Writes the header. Called by the tree the recorder is attached to.
+    void begin(const bytes_t& rootHash, uint64_t size);
+
+    void record(const TraceRecord& record);
+
+    uint64_t records() const { return records_; }
+
+private:
+    std::ostream& out_;
+    std::mutex mutex_;
+    bool begun_;
+    uint64_t records_;
+
+    void writeNumber(uint64_t n);
+    void writeBytes(const bytes_t& bytes);
+};
+
+// Keeps the operations a tree makes on itself out of the trace, so that each operation is recorded once where it
+// entered the tree. Converts to the recorder to use, which is null when nothing should be recorded.
+class TraceScope
+{
+public:
+    explicit TraceScope(TraceRecorder* recorder) : recorder_(recorder && depth()++ == 0 ? recorder : nullptr), counted_(recorder != nullptr) { }
+    ~TraceScope() { if (counted_) { depth()--; } }
+
+    explicit operator bool() const { return recorder_ != nullptr; }
+    TraceRecorder* operator->() const { return recorder_; }
+
+private:
+    TraceRecorder* recorder_;
+    bool counted_;
+
+    static unsigned int& depth();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+// Reads the records of a trace in order.
+class TraceReader
+{
+public:
+    // Reads the header.
+    explicit TraceReader(std::istream& in);
+
+    const bytes_t& rootHash() const { return rootHash_; }
+    uint64_t size() const { return size_; }
+
+    // False at the end of the trace.
+    bool next(TraceRecord& record);
+
+private:
+    std::istream& in_;
+    bytes_t rootHash_;
+    uint64_t size_;
+
+    uint64_t readNumber();
+    bytes_t readBytes();
+    unsigned char readByte();
+};
+
+inline void TraceRecorder::begin(const bytes_t& rootHash, uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (begun_) throw std::runtime_error("Trace has already begun.");
+
+    out_.write(reinterpret_cast<const char*>(TRACE_MAGIC), sizeof(TRACE_MAGIC));
+    out_.put(TRACE_VERSION);
+    writeBytes(rootHash);
+    writeNumber(size);
+    if (!out_) throw std::runtime_error("Failed to write trace.");
+    begun_ = true;
+}
+
+inline void TraceRecorder::record(const TraceRecord& record)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!begun_) throw std::runtime_error("Trace has not begun.");
+
+    out_.put(record.op);
+    switch (record.op)
+    {
+    case TRACE_APPEND:
+        writeBytes(record.data);
+        break;
+
+    case TRACE_UPDATE:
+        writeNumber(record.index);
+        writeBytes(record.data);
+        break;
+
+    case TRACE_GET_LEAF:
+        writeNumber(record.index);
+        break;
+
+    case TRACE_COMMIT:
+        writeBytes(record.data);
+        out_.flush();
+        break;
+
+    case TRACE_APPEND_TXOUT:
+        writeBytes(record.txhash);
+        writeNumber(record.txindex);
+        writeBytes(record.data);
+        break;
+
+    case TRACE_SPEND_TXOUT:
+    case TRACE_GET_TXOUT:
+        writeBytes(record.txhash);
+        writeNumber(record.txindex);
+        break;
+
+    case TRACE_REMOVE:
+    case TRACE_ROLLBACK:
+        break;
+    }
+    if (!out_) throw std::runtime_error("Failed to write trace.");
+    records_++;
+}
+
+inline void TraceRecorder::writeNumber(uint64_t n)
+{
+    int len = 0;
+    if (n < 0xfd)               { out_.put(n); }
+    else if (n <= 0xffff)       { out_.put(0xfd); len = 2; }
+    else if (n <= 0xffffffff)   { out_.put(0xfe); len = 4; }
+    else                        { out_.put(0xff); len = 8; }
+    for (int i = len - 1; i >= 0; i--) { out_.put((n >> (8 * i)) & 0xff); }
+}
+
+inline void TraceRecorder::writeBytes(const bytes_t& bytes)
+{
+    writeNumber(bytes.size());
+    if (!bytes.empty()) { out_.write(reinterpret_cast<const char*>(bytes.data()), bytes.size()); }
+}
+
+inline unsigned int& TraceScope::depth()
+{
+    static thread_local unsigned int depth = 0;
+    return depth;
+}
+
+inline TraceReader::TraceReader(std::istream& in) : in_(in)
+{
+    for (auto c: TRACE_MAGIC)
+    {
+        if (readByte() != c) throw std::runtime_error("Not a trace.");
+    }
+    if (readByte() != TRACE_VERSION) throw std::runtime_error("Unsupported trace version.");
+    rootHash_ = readBytes();
+    size_ = readNumber();
+}
+
+inline bool TraceReader::next(TraceRecord& record)
+{
+    int op = in_.get();
+    if (op == std::char_traits<char>::eof()) return false;
+
+    record = TraceRecord((TraceOp)op);
+    switch (record.op)
+    {
+    case TRACE_APPEND:
+        record.data = readBytes();
+        break;
+
+    case TRACE_UPDATE:
+        record.index = readNumber();
+        record.data = readBytes();
+        break;
+
+    case TRACE_GET_LEAF:
+        record.index = readNumber();
+        break;
+
+    case TRACE_COMMIT:
+        record.data = readBytes();
+        break;
+
+    case TRACE_APPEND_TXOUT:
+        record.txhash = readBytes();
+        record.txindex = readNumber();
+        record.data = readBytes();
+        break;
+
+    case TRACE_SPEND_TXOUT:
+    case TRACE_GET_TXOUT:
+        record.txhash = readBytes();
+        record.txindex = readNumber();
+        break;
+
+    case TRACE_REMOVE:
+    case TRACE_ROLLBACK:
+        break;
+
+    default:
+        throw std::runtime_error("Unknown trace operation.");
+    }
+    return true;
+}
+
+inline unsigned char TraceReader::readByte()
+{
+    int c = in_.get();
+    if (c == std::char_traits<char>::eof()) throw std::runtime_error("Trace is truncated.");
+    return c;
+}
+
+inline uint64_t TraceReader::readNumber()
+{
+    uint64_t n = readByte();
+    int len = (n == 0xfd) ? 2 : (n == 0xfe) ? 4 : (n == 0xff) ? 8 : 0;
+    if (len > 0)
+    {
+        n = 0;
+        for (int i = 0; i < len; i++) { n = (n << 8) | readByte(); }
+    }
+    return n;
+}
+
+inline bytes_t TraceReader::readBytes()
+{
+    uint64_t len = readNumber();
+    bytes_t bytes;
+    // Grow as bytes arrive rather than trusting a length that may be corrupt.
+    while (bytes.size() < len) { bytes.push_back(readByte()); }
+    return bytes;
+}
+
+}
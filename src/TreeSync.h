@@ -0,0 +1,492 @@
+#pragma once
+
+#include "HashTrie.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <istream>
+#include <map>
+#include <set>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+// Node set streams carry the nodes of one tree that are missing from another. Since nodes are keyed by hash,
+// a subtree whose root is already present on the receiving side is skipped without being visited.
+//
+// Stream format:
+//   magic "CLNS", version (1 byte), digest size (1 byte)
+//   base root length (1 byte), base root    - root of the receiving side when the set was made, may be empty
+//   root length (1 byte), root              - root the receiving side has after import, may be empty
+//   node records: length (4 bytes, big endian), serialized node
+//   zero length (4 bytes)
+//
+// Nodes are written children first, so every node only refers to nodes that are already present when it is read.
+// Outpoint index entries of a TxOutTree are not part of the set.
+//
+// Snapshots hold a whole tree as its peaks followed by its leaves in order. Interior nodes are left out since
+// they follow from the leaves. Importing rebuilds every node and checks the result against the peaks and root in
+// the header, so a snapshot from an untrusted source is safe to load as long as its root is trusted.
+//
+// Snapshot format:
+//   magic "CLSS", version (1 byte), digest size (1 byte)
+//   leaf count (8 bytes, big endian)
+//   root length (1 byte), root
+//   peak count (1 byte), peaks              - roots of the perfect subtrees from left to right
+//   leaf records: length (4 bytes, big endian), leaf data
+
+namespace CryptoLedger
+{
+
+const unsigned char NODE_SET_MAGIC[] = { 'C', 'L', 'N', 'S' };
+const unsigned char NODE_SET_VERSION = 1;
+
+// Writes the nodes of source that target lacks, each once. target is any DB holding the receiving side's nodes,
+// for example a local copy of a replica. Returns the number of nodes written.
+template<typename DBModelType, typename HashPolicy>
+uint64_t exportNodeSet(const MMRTree<DBModelType, HashPolicy>& source, const DBModelType& target, std::ostream& out);
+
+// Stores the nodes in a stream made by exportNodeSet, checking each one against its children, then moves the tree
+// to the new root and commits. The set is applied as one batch. Throws if the tree's root does not match the base
+// root the set was made against. Returns the number of nodes read.
+template<typename DBModelType, typename HashPolicy>
+uint64_t importNodeSet(MMRTree<DBModelType, HashPolicy>& tree, std::istream& in);
+
+const unsigned char SNAPSHOT_MAGIC[] = { 'C', 'L', 'S', 'S' };
+const unsigned char SNAPSHOT_VERSION = 1;
+
+// Leaves per unit of work when importing a snapshot. Chunks are aligned perfect subtrees, so each one is built
+// and written on its own.
+const uint64_t SNAPSHOT_CHUNK_SIZE = 1 << 16;
+
+// Writes the tree as a snapshot. Returns the number of leaves written.
+template<typename DBModelType, typename HashPolicy>
+uint64_t exportSnapshot(const MMRTree<DBModelType, HashPolicy>& tree, std::ostream& out);
+
+// Loads a snapshot into an empty tree, hashing chunks on the given number of threads (0 for one per core) and
+// writing each group of chunks as one batch sorted by key. Written chunks are listed as unrooted subtrees of the
+// tree until the root takes them over, so an import that throws, or is interrupted and reopened, frees them. Throws
+// if the rebuilt peaks or root differ from the header. Returns the number of leaves read.
+template<typename DBModelType, typename HashPolicy>
+uint64_t importSnapshot(MMRTree<DBModelType, HashPolicy>& tree, std::istream& in, unsigned int threads = 0);
+
+
+namespace detail
+{
+
+inline void writeBytes(std::ostream& out, const bytes_t& bytes)
+{
+    if (!bytes.empty()) { out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size()); }
+}
+
+inline void writeLength(std::ostream& out, uint32_t len)
+{
+    unsigned char buf[4] = { (unsigned char)(len >> 24), (unsigned char)((len >> 16) & 0xff), (unsigned char)((len >> 8) & 0xff), (unsigned char)(len & 0xff) };
+    out.write(reinterpret_cast<const char*>(buf), sizeof(buf));
+}
+
+inline bytes_t readBytes(std::istream& in, size_t len)
+{
+    bytes_t bytes(len);
+    if (len > 0) { in.read(reinterpret_cast<char*>(&bytes[0]), len); }
+    if (!in) throw std::runtime_error("Stream is truncated.");
+    return bytes;
+}
+
+inline uint32_t readLength(std::istream& in)
+{
+    bytes_t buf = readBytes(in, 4);
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+inline void writeUint64(std::ostream& out, uint64_t n)
+{
+    writeLength(out, n >> 32);
+    writeLength(out, n & 0xffffffff);
+}
+
+inline uint64_t readUint64(std::istream& in)
+{
+    uint64_t high = readLength(in);
+    return (high << 32) | readLength(in);
+}
+
+// Stores nodes in key order, which keeps LevelDB's write path sequential, followed by the payloads of new leaves
+// and of stored leaves missing theirs in the same order. Each node that is new takes a reference to each of its children. Nodes whose parents are not
+// written yet are stored without references until they are.
+template<typename DBModelType, typename HashPolicy>
+void writeSorted(std::vector<MerkleNodePtr<DBModelType, HashPolicy>>& nodes, DBModelType& db)
+{
+    std::sort(nodes.begin(), nodes.end(), [](const MerkleNodePtr<DBModelType, HashPolicy>& a, const MerkleNodePtr<DBModelType, HashPolicy>& b) { return a->hash() < b->hash(); });
+
+    std::map<bytes_t, uint64_t> refs;
+    std::vector<const MerkleNode<DBModelType, HashPolicy>*> leaves;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        const MerkleNode<DBModelType, HashPolicy>& node = *nodes[i];
+        if (i > 0 && node.hash() == nodes[i - 1]->hash()) continue;
+        if (db.exists(node.hash()))
+        {
+            // A stored leaf may have had its payload pruned.
+            if (node.isLeaf() && !db.exists(MerkleNode<DBModelType, HashPolicy>::payloadKey(node.hash()))) { leaves.push_back(&node); }
+            continue;
+        }
+
+        db.batchInsert(node.hash(), node.getStored());
+        if (node.isLeaf())
+        {
+            leaves.push_back(&node);
+            continue;
+        }
+        refs[node.leftChildHash()]++;
+        refs[node.rightChildHash()]++;
+    }
+    for (auto leaf: leaves) { db.batchInsert(MerkleNode<DBModelType, HashPolicy>::payloadKey(leaf->hash()), leaf->data()); }
+    for (auto& ref: refs) { db.batchAddRef(ref.first, ref.second); }
+    nodes.clear();
+}
+
+// Builds the perfect subtree over leaves from pool, appending every node to records. Returns the subtree root.
+template<typename DBModelType, typename HashPolicy>
+MerkleNodePtr<DBModelType, HashPolicy> buildPerfectSubtree(const std::vector<bytes_t>& leaves, MerkleNodePool<DBModelType, HashPolicy>* pool, std::vector<MerkleNodePtr<DBModelType, HashPolicy>>& records)
+{
+    std::vector<MerkleNodePtr<DBModelType, HashPolicy>> level;
+    level.reserve(leaves.size());
+    for (auto& data: leaves)
+    {
+        MerkleNodePtr<DBModelType, HashPolicy> leaf = MerkleNode<DBModelType, HashPolicy>::create(pool);
+        leaf->setData(data);
+        records.push_back(leaf);
+        level.push_back(leaf);
+    }
+
+    while (level.size() > 1)
+    {
+        std::vector<MerkleNodePtr<DBModelType, HashPolicy>> parents;
+        parents.reserve(level.size() / 2);
+        for (size_t i = 0; i + 1 < level.size(); i += 2)
+        {
+            MerkleNodePtr<DBModelType, HashPolicy> parent = MerkleNode<DBModelType, HashPolicy>::create(pool, *level[i], *level[i + 1]);
+            records.push_back(parent);
+            parents.push_back(parent);
+        }
+        level.swap(parents);
+    }
+
+    return level.front();
+}
+
+// Subtrees may repeat within the source, so hashes already written are skipped along with those target holds.
+template<typename DBModelType, typename HashPolicy>
+uint64_t exportSubtree(const MerkleNodePtr<DBModelType, HashPolicy>& node, const DBModelType& source, const DBModelType& target, std::set<bytes_t>& written, std::ostream& out)
+{
+    if (written.count(node->hash()) || target.exists(node->hash())) return 0;
+
+    uint64_t count = 0;
+    if (!node->isLeaf())
+    {
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        node->getChildren(source, leftChild, rightChild);
+        count += exportSubtree(leftChild, source, target, written, out);
+        count += exportSubtree(rightChild, source, target, written, out);
+    }
+
+    if (node->isLeaf()) { node->getData(source); }
+    bytes_t serialized = node->getSerialized();
+    writeLength(out, serialized.size());
+    writeBytes(out, serialized);
+    if (!out) throw std::runtime_error("Failed to write stream.");
+    written.insert(node->hash());
+    return count + 1;
+}
+
+}
+
+template<typename DBModelType, typename HashPolicy>
+uint64_t exportNodeSet(const MMRTree<DBModelType, HashPolicy>& source, const DBModelType& target, std::ostream& out)
+{
+    bytes_t baseRoot;
+    try
+    {
+        target.get(bytes_t(), baseRoot);
+    }
+    catch (...)
+    {
+        baseRoot.clear();
+    }
+
+    out.write(reinterpret_cast<const char*>(NODE_SET_MAGIC), sizeof(NODE_SET_MAGIC));
+    out.put(NODE_SET_VERSION);
+    out.put(HashPolicy::DIGEST_SIZE);
+    out.put(baseRoot.size());
+    detail::writeBytes(out, baseRoot);
+    out.put(source.rootHash().size());
+    detail::writeBytes(out, source.rootHash());
+
+    uint64_t count = 0;
+    std::set<bytes_t> written;
+    if (source.root()) { count = detail::exportSubtree(source.root(), source.db(), target, written, out); }
+
+    detail::writeLength(out, 0);
+    if (!out) throw std::runtime_error("Failed to write stream.");
+    return count;
+}
+
+template<typename DBModelType, typename HashPolicy>
+uint64_t importNodeSet(MMRTree<DBModelType, HashPolicy>& tree, std::istream& in)
+{
+    bytes_t header = detail::readBytes(in, sizeof(NODE_SET_MAGIC) + 2);
+    if (!std::equal(NODE_SET_MAGIC, NODE_SET_MAGIC + sizeof(NODE_SET_MAGIC), header.begin())) throw std::runtime_error("Not a node set.");
+    if (header[4] != NODE_SET_VERSION) throw std::runtime_error("Unsupported node set version.");
+    if (header[5] != HashPolicy::DIGEST_SIZE) throw std::runtime_error("Node set digest size does not match the tree's hash policy.");
+
+    bytes_t baseRoot = detail::readBytes(in, detail::readBytes(in, 1)[0]);
+    bytes_t root = detail::readBytes(in, detail::readBytes(in, 1)[0]);
+    if (baseRoot != tree.rootHash()) throw std::runtime_error("Node set was made against a different root.");
+
+    // The set may refer to nodes of pending appends, so they are stored first.
+    tree.flush();
+    DBModelType& db = tree.db();
+
+    // Sizes of nodes imported so far. Children that were already present are loaded to check them.
+    std::map<bytes_t, uint64_t> sizes;
+
+    // References held by imported nodes that no parent has taken over yet.
+    std::map<bytes_t, uint64_t> unclaimed;
+    auto claim = [&](const bytes_t& hash)
+    {
+        auto it = unclaimed.find(hash);
+        if (it != unclaimed.end() && it->second > 0)    { it->second--; }
+        else                                            { MerkleNode<DBModelType, HashPolicy>::holdRef(hash, db); }
+    };
+    auto childSize = [&](const bytes_t& hash)
+    {
+        auto it = sizes.find(hash);
+        if (it != sizes.end()) return it->second;
+
+        bytes_t serialized;
+        try
+        {
+            db.get(hash, serialized);
+        }
+        catch (...)
+        {
+            throw std::runtime_error("Node set refers to a missing node.");
+        }
+        return MerkleNode<DBModelType, HashPolicy>::createStored(tree.pool(), hash, serialized)->size();
+    };
+
+    uint64_t count = 0;
+    try
+    {
+        while (uint32_t len = detail::readLength(in))
+        {
+            MerkleNodePtr<DBModelType, HashPolicy> stored = MerkleNode<DBModelType, HashPolicy>::create(tree.pool(), detail::readBytes(in, len));
+            const MerkleNode<DBModelType, HashPolicy>& node = *stored;
+            if (node.size() == 0) throw std::runtime_error("Node set holds an invalid node.");
+            if (!node.isLeaf())
+            {
+                if (node.leftChildHash().empty() || node.rightChildHash().empty()) throw std::runtime_error("Node set holds an invalid node.");
+                uint64_t leftSize = childSize(node.leftChildHash());
+                uint64_t rightSize = childSize(node.rightChildHash());
+                if (leftSize != node.leftSize() || leftSize + rightSize != node.size()) throw std::runtime_error("Node set holds an invalid node.");
+                claim(node.leftChildHash());
+                claim(node.rightChildHash());
+            }
+            else if (!node.leftChildHash().empty() || !node.rightChildHash().empty())
+            {
+                throw std::runtime_error("Node set holds an invalid node.");
+            }
+
+            node.store(db);
+            sizes[node.hash()] = node.size();
+            unclaimed[node.hash()]++;
+            count++;
+        }
+
+        if (!root.empty() && !sizes.count(root) && !db.exists(root)) throw std::runtime_error("Node set does not contain its root.");
+        tree.setRoot(root);
+
+        // Nodes that nothing refers to, such as the root now held by the tree, give up their import reference.
+        for (auto& node: unclaimed)
+        {
+            for (uint64_t n = 0; n < node.second; n++) { MerkleNode<DBModelType, HashPolicy>::dropRef(node.first, db, tree.pool()); }
+        }
+        tree.commit();
+    }
+    catch (...)
+    {
+        tree.rollback();
+        throw;
+    }
+
+    return count;
+}
+
+template<typename DBModelType, typename HashPolicy>
+uint64_t exportSnapshot(const MMRTree<DBModelType, HashPolicy>& tree, std::ostream& out)
+{
+    // Each right child on the way down the left spine is a peak, from right to left, and the perfect node the spine
+    // ends on is the leftmost one.
+    std::vector<bytes_t> peaks;
+    MerkleNodePtr<DBModelType, HashPolicy> node = tree.root();
+    while (node && !node->isPerfect())
+    {
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        node->getChildren(tree.db(), leftChild, rightChild);
+        peaks.push_back(rightChild->hash());
+        node = leftChild;
+    }
+    if (node) { peaks.push_back(node->hash()); }
+    std::reverse(peaks.begin(), peaks.end());
+
+    out.write(reinterpret_cast<const char*>(SNAPSHOT_MAGIC), sizeof(SNAPSHOT_MAGIC));
+    out.put(SNAPSHOT_VERSION);
+    out.put(HashPolicy::DIGEST_SIZE);
+    detail::writeUint64(out, tree.size());
+    out.put(tree.rootHash().size());
+    detail::writeBytes(out, tree.rootHash());
+    out.put(peaks.size());
+    for (auto& peak: peaks) { detail::writeBytes(out, peak); }
+
+    uint64_t count = 0;
+    for (auto it = tree.items(0, tree.size(), SNAPSHOT_CHUNK_SIZE); it.valid(); it.next())
+    {
+        detail::writeLength(out, it.data().size());
+        detail::writeBytes(out, it.data());
+        count++;
+    }
+
+    if (!out) throw std::runtime_error("Failed to write stream.");
+    return count;
+}
+
+template<typename DBModelType, typename HashPolicy>
+uint64_t importSnapshot(MMRTree<DBModelType, HashPolicy>& tree, std::istream& in, unsigned int threads)
+{
+    typedef MerkleNodePtr<DBModelType, HashPolicy> node_t;
+
+    if (tree.root()) throw std::runtime_error("Snapshots can only be imported into an empty tree.");
+
+    bytes_t header = detail::readBytes(in, sizeof(SNAPSHOT_MAGIC) + 2);
+    if (!std::equal(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + sizeof(SNAPSHOT_MAGIC), header.begin())) throw std::runtime_error("Not a snapshot.");
+    if (header[4] != SNAPSHOT_VERSION) throw std::runtime_error("Unsupported snapshot version.");
+    if (header[5] != HashPolicy::DIGEST_SIZE) throw std::runtime_error("Snapshot digest size does not match the tree's hash policy.");
+
+    uint64_t leafCount = detail::readUint64(in);
+    bytes_t root = detail::readBytes(in, detail::readBytes(in, 1)[0]);
+    unsigned int peakCount = detail::readBytes(in, 1)[0];
+
+    // Peak sizes are the set bits of the leaf count, largest first.
+    std::vector<uint64_t> peakSizes;
+    for (int bit = 63; bit >= 0; bit--)
+    {
+        if ((leafCount >> bit) & 1) { peakSizes.push_back((uint64_t)1 << bit); }
+    }
+    if (peakSizes.size() != peakCount || root.size() != (leafCount ? HashPolicy::DIGEST_SIZE : 0)) throw std::runtime_error("Snapshot header is invalid.");
+
+    std::vector<bytes_t> peaks;
+    for (unsigned int i = 0; i < peakCount; i++) { peaks.push_back(detail::readBytes(in, HashPolicy::DIGEST_SIZE)); }
+
+    // Chunk sizes and the peak each chunk belongs to, in leaf order.
+    std::vector<std::pair<uint64_t, unsigned int>> chunks;
+    for (unsigned int i = 0; i < peakCount; i++)
+    {
+        uint64_t chunkSize = std::min(peakSizes[i], SNAPSHOT_CHUNK_SIZE);
+        for (uint64_t n = 0; n < peakSizes[i] / chunkSize; n++) { chunks.push_back(std::make_pair(chunkSize, i)); }
+    }
+
+    ThreadPool threadPool(threads ? threads : std::thread::hardware_concurrency());
+    size_t groupSize = 2 * std::max(threadPool.size(), 1u);
+
+    DBModelType& db = tree.db();
+    std::vector<std::vector<node_t>> chunkRoots(peakCount);
+    try
+    {
+        for (size_t group = 0; group < chunks.size(); group += groupSize)
+        {
+            size_t groupEnd = std::min(group + groupSize, chunks.size());
+            std::vector<std::vector<bytes_t>> leaves(groupEnd - group);
+            for (size_t i = group; i < groupEnd; i++)
+            {
+                leaves[i - group].reserve(chunks[i].first);
+                for (uint64_t n = 0; n < chunks[i].first; n++) { leaves[i - group].push_back(detail::readBytes(in, detail::readLength(in))); }
+            }
+
+            std::vector<std::vector<node_t>> records(leaves.size());
+            std::vector<node_t> roots(leaves.size());
+            threadPool.parallel(leaves.size(), [&](uint64_t begin, uint64_t end)
+            {
+                for (uint64_t i = begin; i < end; i++) { roots[i] = detail::buildPerfectSubtree<DBModelType, HashPolicy>(leaves[i], tree.pool(), records[i]); }
+            });
+
+            std::vector<node_t> groupRecords;
+            for (size_t i = 0; i < leaves.size(); i++)
+            {
+                groupRecords.insert(groupRecords.end(), records[i].begin(), records[i].end());
+                chunkRoots[chunks[group + i].second].push_back(roots[i]);
+            }
+            // Chunks hold no references until they are joined.
+            std::vector<bytes_t> chunkHashes;
+            for (auto& chunkRoot: roots) { chunkHashes.push_back(chunkRoot->hash()); }
+            detail::writeSorted(groupRecords, db);
+            tree.batchAddUnrooted(chunkHashes);
+            db.commit();
+        }
+
+        // Join the chunks of each peak, then bag the peaks from the left.
+        std::vector<node_t> records;
+        node_t rootNode;
+        for (unsigned int i = 0; i < peakCount; i++)
+        {
+            std::vector<node_t>& level = chunkRoots[i];
+            while (level.size() > 1)
+            {
+                std::vector<node_t> parents;
+                for (size_t n = 0; n + 1 < level.size(); n += 2)
+                {
+                    node_t parent = MerkleNode<DBModelType, HashPolicy>::create(tree.pool(), *level[n], *level[n + 1]);
+                    records.push_back(parent);
+                    parents.push_back(parent);
+                }
+                level.swap(parents);
+            }
+            if (level.front()->hash() != peaks[i]) throw std::runtime_error("Snapshot peak does not match its leaves.");
+
+            if (rootNode)
+            {
+                rootNode = MerkleNode<DBModelType, HashPolicy>::create(tree.pool(), *rootNode, *level.front());
+                records.push_back(rootNode);
+            }
+            else
+            {
+                rootNode = level.front();
+            }
+        }
+        if (rootNode && rootNode->hash() != root) throw std::runtime_error("Snapshot root does not match its peaks.");
+
+        detail::writeSorted(records, db);
+        tree.batchClearUnrooted();
+        tree.setRoot(root);
+        tree.commit();
+    }
+    catch (...)
+    {
+        // If freeing fails too, the chunks stay listed and are freed when the tree is next opened.
+        tree.rollback();
+        try
+        {
+            tree.freeUnrooted();
+        }
+        catch (...)
+        {
+            db.rollback();
+        }
+        throw;
+    }
+
+    return leafCount;
+}
+
+}
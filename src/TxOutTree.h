@@ -1,13 +1,23 @@
 #pragma once
 
 #include "HashTrie.h"
+#include "ScriptCompressor.h"
 
 namespace CryptoLedger
 {
 
+// Serialized as version, height, flags and script. Items written before script compression have no
+// SCRIPT_COMPRESSED flag and hold the script behind an 8 byte length; they are still read.
 class TxOutItem
 {
 public:
+    enum Flags
+    {
+        COINBASE            = 0x01,
+        SPENT               = 0x02,
+        SCRIPT_COMPRESSED   = 0x04
+    };
+
     TxOutItem(uint32_t version, uint64_t height, bool isCoinBase, bool isSpent, const bytes_t& script)
         : version_(version), height_(height), isCoinBase_(isCoinBase), isSpent_(isSpent), script_(script) { }
 
@@ -58,21 +68,12 @@ bytes_t TxOutItem::getSerialized() const
     rval.push_back((height_ >> 8) & 0xff);
     rval.push_back(height_ & 0xff);
 
-    unsigned char flags = 0x00;
-    if (isCoinBase_) { flags |= 0x01; }
-    if (isSpent_)    { flags |= 0x02; }
+    unsigned char flags = SCRIPT_COMPRESSED;
+    if (isCoinBase_) { flags |= COINBASE; }
+    if (isSpent_)    { flags |= SPENT; }
     rval.push_back(flags);
 
-    uint64_t scriptlen = script_.size();
-    rval.push_back(scriptlen >> 56);
-    rval.push_back((scriptlen >> 48) & 0xff);
-    rval.push_back((scriptlen >> 40) & 0xff);
-    rval.push_back((scriptlen >> 32) & 0xff);
-    rval.push_back((scriptlen >> 24) & 0xff);
-    rval.push_back((scriptlen >> 16) & 0xff);
-    rval.push_back((scriptlen >> 8) & 0xff);
-    rval.push_back(scriptlen & 0xff);
-    rval += script_;
+    ScriptCompressor::compress(script_, rval);
 
     return rval; 
 }
@@ -92,35 +93,99 @@ void TxOutItem::setSerialized(const bytes_t& serialized)
 
     if (serialized.size() < pos + 1) throw std::runtime_error("Invalid TxOutItem serialization.");
     unsigned char flags = serialized[pos];
-    isCoinBase_ = flags & 0x01;
-    isSpent_ = flags & 0x02;
+    isCoinBase_ = flags & COINBASE;
+    isSpent_ = flags & SPENT;
     pos += 1;
 
+    if (flags & SCRIPT_COMPRESSED)
+    {
+        uint64_t scriptpos = pos;
+        script_ = ScriptCompressor::decompress(serialized, scriptpos);
+        return;
+    }
+
     if (serialized.size() < pos + 8) throw std::runtime_error("Invalid TxOutItem serialization.");
     uint64_t scriptlen = ((uint64_t)serialized[pos] << 56) | ((uint64_t)serialized[pos + 1] << 48) | ((uint64_t)serialized[pos + 2] << 40) | ((uint64_t)serialized[pos + 3] << 32)
                        | ((uint64_t)serialized[pos + 4] << 24) | ((uint64_t)serialized[pos + 5] << 16) | ((uint64_t)serialized[pos + 6] << 8) | ((uint64_t)serialized[pos + 7]);
     pos += 8;
 
-    if (serialized.size() < pos + scriptlen) throw std::runtime_error("Invalid TxOutItem serialization.");
+    if (serialized.size() - pos < scriptlen) throw std::runtime_error("Invalid TxOutItem serialization.");
     script_.assign(serialized.begin() + pos, serialized.begin() + pos + scriptlen);
 }
 
 
-template<typename DBModelType>
-class TxOutTree : public MMRTree<DBModelType>
+// In pruned mode an output that has been spent for depth commits loses its data and its outpoint index entry, so
+// only its hash remains in the tree. With collapse set, perfect subtrees whose leaves have all been pruned are
+// reduced to their hash as well. Outputs spent while pruning was off keep their data. Unspent outputs can still be
+// read, spent and proven, and the tree appended to, but spends older than depth can no longer be rolled back.
+// Removing items is unsupported once it would have to split a collapsed subtree: removeItem then throws "Subtree
+// has been pruned." and leaves the tree as it was.
+template<typename DBModelType, typename HashPolicy = Sha256HashPolicy>
+class TxOutTree : public MMRTree<DBModelType, HashPolicy>
 {
 public:
-    explicit TxOutTree(const std::string& dbname) : MMRTree<DBModelType>(dbname) { }
+    explicit TxOutTree(const std::string& dbname, const DBOptions& options = DBOptions());
 
-    using MMRTree<DBModelType>::appendItem;
+    using MMRTree<DBModelType, HashPolicy>::appendItem;
     void appendItem(const bytes_t& txhash, uint32_t txindex, const TxOutItem& txout);
 
-    using MMRTree<DBModelType>::json;
-    std::string json(const MerkleNodePtr<DBModelType>& root) const;
+    uint64_t getItemIndex(const bytes_t& txhash, uint32_t txindex) const;
+    TxOutItem getItem(const bytes_t& txhash, uint32_t txindex) const;
+    void spendItem(const bytes_t& txhash, uint32_t txindex);
+
+    using MMRTree<DBModelType, HashPolicy>::proof;
+    MMRProof proof(const bytes_t& txhash, uint32_t txindex) const { return this->proof(getItemIndex(txhash, txindex)); }
+
+    // The setting is stored with the tree by the next commit and undone by rollback. A depth of 0 stops pruning.
+    void setPruning(uint64_t depth, bool collapse = false);
+    uint64_t pruneDepth() const { return pruneDepth_; }
+    bool collapsesSubtrees() const { return collapse_; }
+
+    void commit();
+    void rollback();
+
+    using MMRTree<DBModelType, HashPolicy>::json;
+    std::string json(const MerkleNodePtr<DBModelType, HashPolicy>& root) const;
+
+protected:
+    bool prunesLeafData() const { return pruned_; }
+    bool prunesSubtrees() const { return collapsed_; }
+
+private:
+    bool pruned_;       // pruning has been enabled, so spent leaves may be missing their data
+    uint64_t pruneDepth_;
+    bool collapse_;
+    bool collapsed_;    // collapsing has been enabled, so pruned subtrees may be missing their children
+    uint64_t commits_;  // commits since pruning was enabled
+
+    static bytes_t outpointKey(const bytes_t& txhash, uint32_t txindex);
+    static bytes_t uint64Bytes(uint64_t n);
+    static uint64_t bytesUint64(const bytes_t& bytes, size_t pos);
+
+    // Pruning settings are stored under PRUNE_KEY as the depth, a flags byte and the commit count. COLLAPSED_FLAG
+    // stays set once collapsing has been enabled. Each spend made in pruned mode is queued under
+    // PRUNE_QUEUE_PREFIX + commit + outpoint + 4 byte outpoint length with its leaf index until its commit is depth
+    // commits old. Txhashes may be of any length, so the trailing length tells queue keys from other keys.
+    enum { PRUNE_KEY = 'p', PRUNE_QUEUE_PREFIX = 'q' };
+    enum { COLLAPSE_FLAG = 0x01, COLLAPSED_FLAG = 0x02 };
+    static bytes_t pruneQueueKey(uint64_t commit, const bytes_t& outpoint);
+    static bool pruneQueueOutpoint(const bytes_t& key, bytes_t& outpoint);
+
+    void loadPruning();
+    void pruneSpent(uint64_t commit);
+    void pruneLeaf(uint64_t i);
+    bool isPruned(const bytes_t& hash, uint64_t size) const;
 };
 
-template<typename DBModelType>
-void TxOutTree<DBModelType>::appendItem(const bytes_t& txhash, uint32_t txindex, const TxOutItem& txout)
+template<typename DBModelType, typename HashPolicy>
+TxOutTree<DBModelType, HashPolicy>::TxOutTree(const std::string& dbname, const DBOptions& options)
+    : MMRTree<DBModelType, HashPolicy>(dbname, options)
+{
+    loadPruning();
+}
+
+template<typename DBModelType, typename HashPolicy>
+bytes_t TxOutTree<DBModelType, HashPolicy>::outpointKey(const bytes_t& txhash, uint32_t txindex)
 {
     // TODO: more compact encoding
     bytes_t outpoint(txhash);
@@ -128,24 +193,294 @@ void TxOutTree<DBModelType>::appendItem(const bytes_t& txhash, uint32_t txindex,
     outpoint.push_back((txindex >> 16) & 0xff);
     outpoint.push_back((txindex >> 8) & 0xff);
     outpoint.push_back(txindex & 0xff);
+    return outpoint;
+}
 
-    uint64_t size = this->size();
-    bytes_t sizebytes;
-    sizebytes.push_back(size >> 56);
-    sizebytes.push_back((size >> 48) & 0xff);
-    sizebytes.push_back((size >> 40) & 0xff);
-    sizebytes.push_back((size >> 32) & 0xff);
-    sizebytes.push_back((size >> 24) & 0xff);
-    sizebytes.push_back((size >> 16) & 0xff);
-    sizebytes.push_back((size >> 8) & 0xff);
-    sizebytes.push_back(size & 0xff); 
-
-    MMRTree<DBModelType>::appendItem(txout.getSerialized());
+template<typename DBModelType, typename HashPolicy>
+bytes_t TxOutTree<DBModelType, HashPolicy>::uint64Bytes(uint64_t n)
+{
+    bytes_t bytes;
+    for (int i = 7; i >= 0; i--) { bytes.push_back((n >> (8 * i)) & 0xff); }
+    return bytes;
+}
+
+template<typename DBModelType, typename HashPolicy>
+uint64_t TxOutTree<DBModelType, HashPolicy>::bytesUint64(const bytes_t& bytes, size_t pos)
+{
+    if (bytes.size() < pos + 8) throw std::runtime_error("Invalid integer encoding.");
+
+    uint64_t n = 0;
+    for (size_t i = pos; i < pos + 8; i++) { n = (n << 8) | bytes[i]; }
+    return n;
+}
+
+template<typename DBModelType, typename HashPolicy>
+bytes_t TxOutTree<DBModelType, HashPolicy>::pruneQueueKey(uint64_t commit, const bytes_t& outpoint)
+{
+    bytes_t key(1, PRUNE_QUEUE_PREFIX);
+    bytes_t commitbytes = uint64Bytes(commit);
+    key.insert(key.end(), commitbytes.begin(), commitbytes.end());
+    key.insert(key.end(), outpoint.begin(), outpoint.end());
+    if (outpoint.empty()) return key;
+
+    uint32_t len = outpoint.size();
+    key.push_back(len >> 24);
+    key.push_back((len >> 16) & 0xff);
+    key.push_back((len >> 8) & 0xff);
+    key.push_back(len & 0xff);
+    return key;
+}
+
+// Returns false for keys in the queue range that are not queue keys.
+template<typename DBModelType, typename HashPolicy>
+bool TxOutTree<DBModelType, HashPolicy>::pruneQueueOutpoint(const bytes_t& key, bytes_t& outpoint)
+{
+    if (key.size() < 13 || key[0] != PRUNE_QUEUE_PREFIX) return false;
+
+    size_t end = key.size() - 4;
+    uint32_t len = ((uint32_t)key[end] << 24) | ((uint32_t)key[end + 1] << 16) | ((uint32_t)key[end + 2] << 8) | (uint32_t)key[end + 3];
+    if (len != end - 9) return false;
+
+    outpoint.assign(key.begin() + 9, key.begin() + end);
+    return true;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::appendItem(const bytes_t& txhash, uint32_t txindex, const TxOutItem& txout)
+{
+    TraceScope trace(this->trace_);
+    if (trace)
+    {
+        TraceRecord record(TRACE_APPEND_TXOUT);
+        record.txhash = txhash;
+        record.txindex = txindex;
+        record.data = txout.getSerialized();
+        trace->record(record);
+    }
+
+    bytes_t outpoint = outpointKey(txhash, txindex);
+    bytes_t sizebytes = uint64Bytes(this->size());
+
+    MMRTree<DBModelType, HashPolicy>::appendItem(txout.getSerialized());
     this->db_.batchInsert(outpoint, sizebytes);
 }
 
-template<typename DBModelType>
-std::string TxOutTree<DBModelType>::json(const MerkleNodePtr<DBModelType>& root) const
+template<typename DBModelType, typename HashPolicy>
+uint64_t TxOutTree<DBModelType, HashPolicy>::getItemIndex(const bytes_t& txhash, uint32_t txindex) const
+{
+    bytes_t sizebytes;
+    try
+    {
+        this->db_.get(outpointKey(txhash, txindex), sizebytes);
+    }
+    catch (...)
+    {
+        throw std::runtime_error("Outpoint not found.");
+    }
+    if (sizebytes.size() != 8) throw std::runtime_error("Invalid outpoint index.");
+
+    uint64_t i = 0;
+    for (auto byte: sizebytes) { i = (i << 8) | byte; }
+    return i;
+}
+
+template<typename DBModelType, typename HashPolicy>
+TxOutItem TxOutTree<DBModelType, HashPolicy>::getItem(const bytes_t& txhash, uint32_t txindex) const
+{
+    TraceScope trace(this->trace_);
+    if (trace)
+    {
+        TraceRecord record(TRACE_GET_TXOUT);
+        record.txhash = txhash;
+        record.txindex = txindex;
+        trace->record(record);
+    }
+
+    return TxOutItem(this->getLeaf(getItemIndex(txhash, txindex))->getData(this->db_));
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::spendItem(const bytes_t& txhash, uint32_t txindex)
+{
+    TraceScope trace(this->trace_);
+    if (trace)
+    {
+        TraceRecord record(TRACE_SPEND_TXOUT);
+        record.txhash = txhash;
+        record.txindex = txindex;
+        trace->record(record);
+    }
+
+    uint64_t i = getItemIndex(txhash, txindex);
+    TxOutItem txout(this->getLeaf(i)->getData(this->db_));
+    if (txout.isSpent()) throw std::runtime_error("Outpoint is already spent.");
+
+    txout.setSpent(true);
+    this->updateItem(i, txout.getSerialized());
+    if (pruneDepth_ > 0) { this->db_.batchInsert(pruneQueueKey(commits_ + 1, outpointKey(txhash, txindex)), uint64Bytes(i)); }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::loadPruning()
+{
+    pruned_ = false;
+    pruneDepth_ = 0;
+    collapse_ = false;
+    collapsed_ = false;
+    commits_ = 0;
+
+    bytes_t settings;
+    try
+    {
+        this->db_.get(bytes_t(1, PRUNE_KEY), settings);
+    }
+    catch (...)
+    {
+        return;
+    }
+    if (settings.size() != 17) throw std::runtime_error("Invalid pruning settings.");
+
+    pruned_ = true;
+    pruneDepth_ = bytesUint64(settings, 0);
+    collapse_ = ((settings[8] & COLLAPSE_FLAG) != 0);
+    collapsed_ = ((settings[8] & (COLLAPSE_FLAG | COLLAPSED_FLAG)) != 0);
+    commits_ = bytesUint64(settings, 9);
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::setPruning(uint64_t depth, bool collapse)
+{
+    pruned_ = true;
+    pruneDepth_ = depth;
+    collapse_ = collapse;
+    collapsed_ = collapsed_ || collapse;
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::commit()
+{
+    // Pruning reads the tree from the DB.
+    this->flush();
+    if (pruned_)
+    {
+        commits_++;
+        if (pruneDepth_ > 0 && commits_ > pruneDepth_) { pruneSpent(commits_ - pruneDepth_); }
+
+        bytes_t settings = uint64Bytes(pruneDepth_);
+        settings.push_back((collapse_ ? COLLAPSE_FLAG : 0) | (collapsed_ ? COLLAPSED_FLAG : 0));
+        bytes_t commitbytes = uint64Bytes(commits_);
+        settings.insert(settings.end(), commitbytes.begin(), commitbytes.end());
+        this->db_.batchInsert(bytes_t(1, PRUNE_KEY), settings);
+    }
+    MMRTree<DBModelType, HashPolicy>::commit();
+
+    // The root may have been collapsed under the copy held in memory.
+    if (collapse_) { this->loadRoot(); }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::rollback()
+{
+    MMRTree<DBModelType, HashPolicy>::rollback();
+    loadPruning();
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::pruneSpent(uint64_t commit)
+{
+    // Batch updates invalidate iterators, so the queue is read before anything is pruned. Outpoint keys for txhashes
+    // that start with the queue prefix, and node keys that do, fall in the same range and are skipped.
+    std::vector<std::pair<bytes_t, bytes_t>> queue;
+    for (DBIteratorPtr it = this->db_.newIterator(pruneQueueKey(0, bytes_t()), pruneQueueKey(commit + 1, bytes_t())); it->valid(); it->next())
+    {
+        bytes_t outpoint;
+        if (it->value().size() != 8 || !pruneQueueOutpoint(it->key(), outpoint)) continue;
+        queue.push_back(std::make_pair(it->key(), it->value()));
+    }
+
+    for (auto& entry: queue)
+    {
+        this->db_.batchRemove(entry.first);
+
+        // The output may have been removed and its index reused since it was spent.
+        bytes_t outpoint;
+        pruneQueueOutpoint(entry.first, outpoint);
+        bytes_t indexbytes;
+        try
+        {
+            this->db_.get(outpoint, indexbytes);
+        }
+        catch (...)
+        {
+            continue;
+        }
+        if (indexbytes != entry.second) continue;
+
+        uint64_t i = bytesUint64(indexbytes, 0);
+        if (i >= this->size()) continue;
+        pruneLeaf(i);
+        this->db_.batchRemove(outpoint);
+    }
+}
+
+template<typename DBModelType, typename HashPolicy>
+void TxOutTree<DBModelType, HashPolicy>::pruneLeaf(uint64_t i)
+{
+    // Read the path from the DB rather than through the root in memory, whose subtrees an earlier pass may have
+    // collapsed.
+    bytes_t record;
+    this->db_.get(this->rootHash(), record);
+    MerkleNodePtr<DBModelType, HashPolicy> node = MerkleNode<DBModelType, HashPolicy>::createStored(this->pool_, this->rootHash(), record);
+    std::vector<MerkleNodePtr<DBModelType, HashPolicy>> path;
+    while (!node->isLeaf())
+    {
+        if (node->isPruned()) return;
+
+        path.push_back(node);
+        uint64_t leftSize = node->leftSize();
+        if (i < leftSize)
+        {
+            node = node->getLeftChild(this->db_);
+        }
+        else
+        {
+            i -= leftSize;
+            node = node->getRightChild(this->db_);
+        }
+    }
+
+    // An identical leaf may have been pruned already.
+    if (!this->db_.exists(MerkleNode<DBModelType, HashPolicy>::payloadKey(node->hash()))) return;
+    if (!TxOutItem(node->getData(this->db_)).isSpent()) return;
+    node->prune(this->db_);
+    if (!collapse_) return;
+
+    // Collapse each perfect ancestor once its other child is pruned as well.
+    while (!path.empty() && path.back()->isPerfect())
+    {
+        const MerkleNodePtr<DBModelType, HashPolicy>& parent = path.back();
+        bool fromLeft = (node->hash() == parent->leftChildHash());
+        const bytes_t& sibling = fromLeft ? parent->rightChildHash() : parent->leftChildHash();
+        if (!isPruned(sibling, node->size())) return;
+
+        parent->prune(this->db_);
+        node = parent;
+        path.pop_back();
+    }
+}
+
+template<typename DBModelType, typename HashPolicy>
+bool TxOutTree<DBModelType, HashPolicy>::isPruned(const bytes_t& hash, uint64_t size) const
+{
+    if (size == 1) return !this->db_.exists(MerkleNode<DBModelType, HashPolicy>::payloadKey(hash));
+
+    bytes_t record;
+    this->db_.get(hash, record);
+    return MerkleNode<DBModelType, HashPolicy>::createStored(this->pool_, hash, record)->isPruned();
+}
+
+template<typename DBModelType, typename HashPolicy>
+std::string TxOutTree<DBModelType, HashPolicy>::json(const MerkleNodePtr<DBModelType, HashPolicy>& root) const
 {
     if (!root) return "null";
 
@@ -153,11 +488,15 @@ std::string TxOutTree<DBModelType>::json(const MerkleNodePtr<DBModelType>& root)
     ss << "{";
     ss << "\"size\":" << root->size() << ","
        << "\"hash\":\"" << uchar_vector(root->hash()).getHex() << "\",";
-    if (root->isLeaf())
+    if (root->isLeaf() && pruned_ && !this->db_.exists(MerkleNode<DBModelType, HashPolicy>::payloadKey(root->hash())))
+    {
+        ss << "\"pruned\":true";
+    }
+    else if (root->isLeaf())
     {
         try
         {
-            TxOutItem txout(root->data());
+            TxOutItem txout(root->getData(this->db_));
             ss << "\"version\":" << txout.version() << ","
                << "\"height\":" << txout.height() << ","
                << "\"coinbase\":" << (txout.isCoinBase() ? "true" : "false") << ","
@@ -169,10 +508,16 @@ std::string TxOutTree<DBModelType>::json(const MerkleNodePtr<DBModelType>& root)
             ss << "\"error\":\"" << e.what() << "\"";
         }
     }
+    else if (root->isPruned())
+    {
+        ss << "\"pruned\":true";
+    }
     else
     {
-        ss << "\"left\":" << json(root->getLeftChild(this->db_)) << ","
-           << "\"right\":" << json(root->getRightChild(this->db_));
+        MerkleNodePtr<DBModelType, HashPolicy> leftChild, rightChild;
+        root->getChildren(this->db_, leftChild, rightChild);
+        ss << "\"left\":" << json(leftChild) << ","
+           << "\"right\":" << json(rightChild);
     }
     ss << "}";
 